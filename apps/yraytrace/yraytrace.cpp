@@ -38,7 +38,12 @@ using namespace yocto;
 
 // render scene offline
 void run_offline(const string& filename, const string& output,
-    const raytrace_params& params_) {
+    const string& convergence, const string& heatmap, bool bvhstats,
+    float budget, float noise, const string& checkpoint, float interval,
+    bool resume, const string& merge, const raytrace_params& params_) {
+  // time the whole frame, since the time budget includes loading
+  auto timer = simple_timer{};
+
   // copy params
   auto params = params_;
 
@@ -57,21 +62,94 @@ void run_offline(const string& filename, const string& output,
   auto bvh = make_bvh(scene, params);
   print_progress_end();
 
+  // bvh stats
+  if (bvhstats) {
+    for (auto& stat : bvh_stats(bvh)) print_info(stat);
+  }
+
+  // init lights
+  print_progress_begin("init lights");
+  auto lights = make_lights(scene, params);
+  print_progress_end();
+
   // state
   print_progress_begin("init state");
   auto state = make_state(scene, params);
+  if (resume && path_exists(checkpoint)) {
+    if (!load_state(checkpoint, state, scene, params, error))
+      print_fatal(error);
+  }
+  if (!merge.empty()) {
+    if (!merge_state(merge, state, scene, params, error)) print_fatal(error);
+  }
   print_progress_end();
 
-  // render
+  // render, stopping before a pass that, estimated as long as the slowest
+  // one so far with its checkpoint save, would not leave time for the final
+  // writes within the time budget of the frame, or when the image error is
+  // below the noise target, and saving a checkpoint every interval
+  reset_bvh_counters();
+  auto last_saved   = elapsed_seconds(timer);
+  auto slowest_pass = 0.0;
+  auto slowest_save = 0.0;
+  auto write_margin = budget * 0.05;  // share kept for the image writes
   print_progress_begin("render image", params.samples);
-  for (auto sample = 0; sample < params.samples; sample++) {
-    raytrace_samples(state, scene, bvh, params);
-    print_progress_next();
+  while (state.samples < params.samples) {
+    auto pass_start = elapsed_seconds(timer);
+    if (budget > 0 &&
+        pass_start + slowest_pass + slowest_save + write_margin >= budget)
+      break;
+    raytrace_samples(state, scene, bvh, lights, params);
+    print_progress("render image", state.samples, params.samples);
+    auto save_start = elapsed_seconds(timer);
+    if (!checkpoint.empty() && save_start - last_saved >= interval) {
+      if (!save_state(checkpoint, state, scene, params, error))
+        print_fatal(error);
+      last_saved   = elapsed_seconds(timer);
+      slowest_save = std::max(slowest_save, last_saved - save_start);
+    }
+    slowest_pass = std::max(slowest_pass, elapsed_seconds(timer) - pass_start);
+    if (noise > 0 && get_error(state) <= noise) break;
+  }
+  auto frame_time   = elapsed_seconds(timer);
+  auto render_error = get_error(state);
+  if (!checkpoint.empty()) {
+    if (!save_state(checkpoint, state, scene, params, error))
+      print_fatal(error);
+  }
+
+  // traversal stats, per kind of ray
+  if (bvhstats && bvh_counting) {
+    auto counters = get_bvh_counters();
+    for (auto ray = 0; ray < (int)raytrace_ray_names.size(); ray++) {
+      print_info(raytrace_ray_names[ray] + " rays");
+      for (auto& stat : bvh_stats(counters[ray])) print_info(stat);
+    }
   }
 
-  // save image
+  // save image, with the samples, error and frame time up to the end of
+  // rendering, loading included, in a json file next to it when the render
+  // may stop early
   print_progress_begin("save image");
   if (!save_image(output, get_render(state), error)) print_fatal(error);
+  if (!convergence.empty()) {
+    if (!save_image(convergence, get_convergence(state), error))
+      print_fatal(error);
+  }
+  if (!heatmap.empty()) {
+    if (!save_image(heatmap, get_heatmap(state), error)) print_fatal(error);
+  }
+  if (budget > 0 || noise > 0) {
+    auto error_value = render_error < flt_max ? std::to_string(render_error)
+                                              : "null"s;
+    auto metadata    = "{\n"s;
+    metadata += "  \"samples\": " + std::to_string(state.samples) + ",\n";
+    metadata += "  \"error\": " + error_value + ",\n";
+    metadata += "  \"time\": " + std::to_string(frame_time) + "\n";
+    metadata += "}\n";
+    if (!save_text(replace_extension(output, ".json"), metadata, error))
+      print_fatal(error);
+  }
   print_progress_end();
 }
 
@@ -96,6 +174,11 @@ void run_interactive(const string& filename, const string& output,
   auto bvh = make_bvh(scene, params);
   print_progress_end();
 
+  // init lights
+  print_progress_begin("init lights");
+  auto lights = make_lights(scene, params);
+  print_progress_end();
+
   // init state
   print_progress_begin("init state");
   auto state   = make_state(scene, params);
@@ -139,7 +222,7 @@ void run_interactive(const string& filename, const string& output,
     pparams.resolution /= params.pratio;
     pparams.samples = 1;
     auto pstate     = make_state(scene, pparams);
-    raytrace_samples(pstate, scene, bvh, pparams);
+    raytrace_samples(pstate, scene, bvh, lights, pparams);
     auto preview = get_render(pstate);
     for (auto idx = 0; idx < state.width * state.height; idx++) {
       auto i = idx % render.width, j = idx / render.width;
@@ -158,9 +241,9 @@ void run_interactive(const string& filename, const string& output,
 
     // start renderer
     render_worker = std::async(std::launch::async, [&]() {
-      for (auto sample = 0; sample < params.samples; sample += 1) {
+      while (state.samples < params.samples) {
         if (render_stop) return;
-        raytrace_samples(state, scene, bvh, params);
+        raytrace_samples(state, scene, bvh, lights, params);
         if (!render_stop) {
           auto lock      = std::lock_guard{render_mutex};
           render_current = state.samples;
@@ -217,6 +300,7 @@ void run_interactive(const string& filename, const string& output,
       edited += draw_glcombobox("camera", tparams.camera, camera_names);
       edited += draw_glslider("resolution", tparams.resolution, 180, 4096);
       edited += draw_glslider("samples", tparams.samples, 16, 4096);
+      edited += draw_glslider("batch", tparams.batch, 1, 16);
       edited += draw_glcombobox(
           "shader", (int&)tparams.shader, raytrace_shader_names);
       edited += draw_glslider("bounces", tparams.bounces, 1, 128);
@@ -282,7 +366,16 @@ void run(const vector<string>& args) {
   auto params      = raytrace_params{};
   auto filename    = "scene.json"s;
   auto output      = "image.png"s;
+  auto convergence = ""s;
+  auto heatmap     = ""s;
   auto interactive = false;
+  auto bvhstats    = false;
+  auto budget      = 0.0f;
+  auto noise       = 0.0f;
+  auto checkpoint  = ""s;
+  auto interval    = 60.0f;
+  auto resume      = false;
+  auto merge       = ""s;
 
   // command line parsing
   auto error = string{};
@@ -295,13 +388,48 @@ void run(const vector<string>& args) {
   add_option(
       cli, "shader", params.shader, "Shader type.", raytrace_shader_names);
   add_option(cli, "samples", params.samples, "Number of samples.", {1, 4096});
+  add_option(cli, "time", budget, "Frame time budget in seconds.", {0, 1e6f});
+  add_option(cli, "noise", noise, "Target image error.", {0, 1});
+  add_option(cli, "batch", params.batch, "Samples per pass.", {1, 64});
+  add_option(cli, "seed", params.seed, "Random seed.");
+  add_option(
+      cli, "sequence", params.sequence, "Sampling sequence.", sequence_names);
   add_option(cli, "bounces", params.bounces, "Number of bounces.", {1, 8});
+  add_option(cli, "adaptive", params.adaptive, "Adaptive sampling.");
+  add_option(
+      cli, "threshold", params.threshold, "Adaptive error threshold.", {0, 1});
+  add_option(cli, "convergence", convergence, "Convergence map filename.");
+  add_option(cli, "heatmap", heatmap, "Traversal cost heatmap filename.");
+  add_option(cli, "checkpoint", checkpoint, "Checkpoint filename.");
+  add_option(
+      cli, "interval", interval, "Checkpoint interval in seconds.", {0, 1e6f});
+  add_option(cli, "resume", resume, "Resume from the checkpoint.");
+  add_option(cli, "merge", merge, "Checkpoint to merge, with another seed.");
+  add_option(cli, "nolights", params.nolights, "Disable light sampling.");
+  add_option(
+      cli, "highqualitybvh", params.highqualitybvh, "Use a SAH bvh.");
+  add_option(cli, "widebvh", params.widebvh, "Use a 4-wide bvh.");
+  add_option(cli, "trianglesbvh", params.trianglesbvh,
+      "Store triangles in the bvh.");
+  add_option(cli, "linearbvh", params.linearbvh, "Use a Morton-code bvh.");
+  add_option(cli, "spatialbvh", params.spatialbvh, "Use spatial splits.");
+  add_option(cli, "lazybvh", params.lazybvh, "Build shape bvhs on first use.");
+  add_option(cli, "bvhstats", bvhstats, "Print bvh statistics.");
+  add_option(cli, "bvhcache", params.bvhcache, "Bvh cache directory.");
+  add_option(cli, "packets", params.packets, "Trace camera rays in packets.");
+  add_option(cli, "wavefront", params.wavefront, "Trace paths as wavefronts.");
   add_option(cli, "noparallel", params.noparallel, "Disable threading.");
+  add_option(cli, "tile", params.tile, "Tile size.", {1, 256});
   if (!parse_cli(cli, args, error)) print_fatal(error);
+  if (!heatmap.empty() && !bvh_counting)
+    print_fatal("heatmaps need a build with YOCTO_BVH_STATS");
+  if (resume && checkpoint.empty())
+    print_fatal("resuming needs a checkpoint filename");
 
   // run
   if (!interactive) {
-    run_offline(filename, output, params);
+    run_offline(filename, output, convergence, heatmap, bvhstats, budget,
+        noise, checkpoint, interval, resume, merge, params);
   } else {
     run_interactive(filename, output, params);
   }
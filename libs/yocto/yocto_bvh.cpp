@@ -35,10 +35,16 @@
 #include <algorithm>
 #include <array>
 #include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
 #include <cstring>
+#include <filesystem>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <utility>
 
 #include "yocto_geometry.h"
@@ -48,6 +54,22 @@
 #include <embree3/rtcore.h>
 #endif
 
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define YOCTO_BVH_SSE
+#endif
+
 // -----------------------------------------------------------------------------
 // USING DIRECTIVES
 // -----------------------------------------------------------------------------
@@ -308,12 +330,298 @@ static bool intersect_embree_bvh(const bvh_data& bvh, const scene_data& scene,
 
 }  // namespace yocto
 
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR BVH CACHE
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Version of the bvh file format. Bump it when the layout of the saved data,
+// or the way bvhs are built, changes.
+const uint32_t bvh_file_version = 1;
+
+// Header of bvh files. Sizes of the stored types are kept to detect files
+// written by incompatible builds.
+struct bvh_file_header {
+  array<char, 8> magic          = {'y', 'o', 'c', 't', 'o', 'b', 'v', 'h'};
+  uint32_t       version        = bvh_file_version;
+  uint32_t       node_size      = (uint32_t)sizeof(bvh_node);
+  uint32_t       wide_node_size = (uint32_t)sizeof(bvh_node4);
+  uint32_t       triangle_size  = (uint32_t)sizeof(bvh_triangle);
+  uint64_t       hash           = 0;
+  uint64_t       nodes          = 0;
+  uint64_t       wide_nodes     = 0;
+  uint64_t       primitives     = 0;
+  uint64_t       triangles      = 0;
+};
+
+// Hash of shape geometry and build options
+uint64_t bvh_hash(const shape_data& shape, const bvh_params& params) {
+  // 64-bit FNV-1a, on words rather than bytes since inputs are large
+  auto hash      = (uint64_t)14695981039346656037ull;
+  auto hash_word = [&hash](uint64_t word) {
+    hash = (hash ^ word) * 1099511628211ull;
+  };
+  auto hash_vector = [&hash_word](const auto& values) {
+    auto size = values.size() * sizeof(values[0]);
+    auto data = (const unsigned char*)values.data();
+    hash_word(size);
+    for (auto idx = (size_t)0; idx + 8 <= size; idx += 8) {
+      auto word = (uint64_t)0;
+      memcpy(&word, data + idx, 8);
+      hash_word(word);
+    }
+    for (auto idx = size - size % 8; idx < size; idx++) hash_word(data[idx]);
+  };
+
+  // hash options and geometry
+  hash_word(bvh_file_version);
+  hash_word(params.highquality);
+  hash_word(params.linear);
+  hash_word(params.spatial);
+  hash_word(params.wide);
+  hash_word(params.triangles);
+  hash_vector(shape.points);
+  hash_vector(shape.lines);
+  hash_vector(shape.triangles);
+  hash_vector(shape.quads);
+  hash_vector(shape.positions);
+  hash_vector(shape.radius);
+  return hash;
+}
+
+// Save a bvh. Data is written to a temporary file first, then renamed, so
+// that concurrent readers never see partial files. Temporary files are
+// named by process and thread, so that concurrent writers, in this or other
+// processes sharing the cache, never write to the same file.
+bool save_bvh(const string& filename, const bvh_data& bvh, uint64_t hash,
+    string& error) {
+#ifdef _WIN32
+  auto process = (uint64_t)GetCurrentProcessId();
+#else
+  auto process = (uint64_t)getpid();
+#endif
+  auto thread = std::hash<std::thread::id>{}(std::this_thread::get_id());
+  auto path   = std::filesystem::u8path(filename);
+  auto temp   = path;
+  temp += "." + std::to_string(process) + "." + std::to_string(thread) +
+          ".tmp";
+
+  // header
+  auto header       = bvh_file_header{};
+  header.hash       = hash;
+  header.nodes      = bvh.nodes.size();
+  header.wide_nodes = bvh.wide_nodes.size();
+  header.primitives = bvh.primitives.size();
+  header.triangles  = bvh.triangles.size();
+
+  // write
+#ifdef _WIN32
+  auto fs = _wfopen(temp.c_str(), L"wb");
+#else
+  auto fs = fopen(temp.c_str(), "wb");
+#endif
+  if (!fs) {
+    error = filename + ": file not found";
+    return false;
+  }
+  auto write_values = [fs](const void* data, size_t size) {
+    return size == 0 || fwrite(data, size, 1, fs) == 1;
+  };
+  auto ok = write_values(&header, sizeof(header)) &&
+            write_values(
+                bvh.nodes.data(), bvh.nodes.size() * sizeof(bvh_node)) &&
+            write_values(bvh.wide_nodes.data(),
+                bvh.wide_nodes.size() * sizeof(bvh_node4)) &&
+            write_values(
+                bvh.primitives.data(), bvh.primitives.size() * sizeof(int)) &&
+            write_values(bvh.triangles.data(),
+                bvh.triangles.size() * sizeof(bvh_triangle));
+  if (fclose(fs) != 0) ok = false;
+  if (!ok) {
+    auto ec = std::error_code{};
+    std::filesystem::remove(temp, ec);
+    error = filename + ": write error";
+    return false;
+  }
+
+  // move in place
+  auto ec = std::error_code{};
+  std::filesystem::rename(temp, path, ec);
+  if (ec) {
+    std::filesystem::remove(temp, ec);
+    error = filename + ": write error";
+    return false;
+  }
+  return true;
+}
+
+// Read-only memory map of a file, unmapped when destroyed.
+struct bvh_mapped_file {
+  const char* data = nullptr;
+  size_t      size = 0;
+#ifdef _WIN32
+  HANDLE file    = INVALID_HANDLE_VALUE;
+  HANDLE mapping = nullptr;
+#else
+  int file = -1;
+#endif
+
+  bvh_mapped_file() {}
+  bvh_mapped_file(const bvh_mapped_file&) = delete;
+  bvh_mapped_file& operator=(const bvh_mapped_file&) = delete;
+  ~bvh_mapped_file() {
+#ifdef _WIN32
+    if (data) UnmapViewOfFile(data);
+    if (mapping) CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+    if (data) munmap((void*)data, size);
+    if (file >= 0) close(file);
+#endif
+  }
+};
+
+// Map a file in memory
+static bool map_file(const string& filename, bvh_mapped_file& mapped) {
+  auto path = std::filesystem::u8path(filename);
+#ifdef _WIN32
+  mapped.file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+      nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (mapped.file == INVALID_HANDLE_VALUE) return false;
+  auto size = LARGE_INTEGER{};
+  if (!GetFileSizeEx(mapped.file, &size)) return false;
+  mapped.size = (size_t)size.QuadPart;
+  if (mapped.size == 0) return true;
+  mapped.mapping = CreateFileMappingW(
+      mapped.file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (!mapped.mapping) return false;
+  mapped.data = (const char*)MapViewOfFile(
+      mapped.mapping, FILE_MAP_READ, 0, 0, 0);
+  return mapped.data != nullptr;
+#else
+  mapped.file = open(path.c_str(), O_RDONLY);
+  if (mapped.file < 0) return false;
+  struct stat info;
+  if (fstat(mapped.file, &info) != 0) return false;
+  mapped.size = (size_t)info.st_size;
+  if (mapped.size == 0) return true;
+  auto data = mmap(
+      nullptr, mapped.size, PROT_READ, MAP_PRIVATE, mapped.file, 0);
+  if (data == MAP_FAILED) return false;
+  mapped.data = (const char*)data;
+  return true;
+#endif
+}
+
+// Load a bvh
+bool load_bvh(
+    const string& filename, bvh_data& bvh, uint64_t hash, string& error) {
+  // map file
+  auto mapped = bvh_mapped_file{};
+  if (!map_file(filename, mapped)) {
+    error = filename + ": file not found";
+    return false;
+  }
+
+  // check header
+  auto header = bvh_file_header{};
+  if (mapped.size < sizeof(header)) {
+    error = filename + ": corrupted file";
+    return false;
+  }
+  memcpy(&header, mapped.data, sizeof(header));
+  auto expected = bvh_file_header{};
+  if (header.magic != expected.magic || header.version != expected.version ||
+      header.node_size != expected.node_size ||
+      header.wide_node_size != expected.wide_node_size ||
+      header.triangle_size != expected.triangle_size) {
+    error = filename + ": unsupported format";
+    return false;
+  }
+  if (header.hash != hash) {
+    error = filename + ": stale file";
+    return false;
+  }
+  auto size = sizeof(header) + header.nodes * sizeof(bvh_node) +
+              header.wide_nodes * sizeof(bvh_node4) +
+              header.primitives * sizeof(int) +
+              header.triangles * sizeof(bvh_triangle);
+  if (mapped.size != size) {
+    error = filename + ": corrupted file";
+    return false;
+  }
+
+  // copy data
+  auto offset      = sizeof(header);
+  auto read_values = [&mapped, &offset](auto& values, size_t count) {
+    values.resize(count);
+    if (count == 0) return;
+    memcpy(values.data(), mapped.data + offset, count * sizeof(values[0]));
+    offset += count * sizeof(values[0]);
+  };
+  bvh = bvh_data{};
+  read_values(bvh.nodes, header.nodes);
+  read_values(bvh.wide_nodes, header.wide_nodes);
+  read_values(bvh.primitives, header.primitives);
+  read_values(bvh.triangles, header.triangles);
+  return true;
+}
+
+// Name of the cache entry of a shape
+static string bvh_cache_filename(const string& cache, uint64_t hash) {
+  auto name = array<char, 32>{};
+  snprintf(name.data(), name.size(), "%016llx.bvh", (unsigned long long)hash);
+  return (std::filesystem::u8path(cache) / name.data()).u8string();
+}
+
+}  // namespace yocto
+
 // -----------------------------------------------------------------------------
 // IMPLEMENTATION FOR BVH BUILD
 // -----------------------------------------------------------------------------
 namespace yocto {
 
-// Splits a BVH node using the SAH heuristic. Returns split position and axis.
+// Morton code of a point within a bounding box, with 10 bits per axis.
+static uint32_t morton_code(const vec3f& position, const bbox3f& bbox) {
+  auto expand = [](uint32_t x) {
+    x = (x | (x << 16)) & 0x030000ffu;
+    x = (x | (x << 8)) & 0x0300f00fu;
+    x = (x | (x << 4)) & 0x030c30c3u;
+    x = (x | (x << 2)) & 0x09249249u;
+    return x;
+  };
+  auto code = 0u;
+  for (auto axis = 0; axis < 3; axis++) {
+    auto size = bbox.max[axis] - bbox.min[axis];
+    auto t = size > 0 ? (position[axis] - bbox.min[axis]) / size : 0.0f;
+    code |= expand((uint32_t)clamp(t * 1024, 0.0f, 1023.0f)) << (2 - axis);
+  }
+  return code;
+}
+
+// Sort 32-bit keys with a least significant digit radix sort, in passes of
+// 8 bits. Returns the indices of the keys in sorted order.
+static vector<int> sort_keys(const vector<uint32_t>& keys) {
+  auto order  = vector<int>(keys.size());
+  auto sorted = vector<int>(keys.size());
+  for (auto idx = 0; idx < (int)keys.size(); idx++) order[idx] = idx;
+  if (keys.empty()) return order;
+  for (auto shift = 0; shift < 32; shift += 8) {
+    auto offsets = array<int, 257>{};
+    for (auto key : keys) offsets[((key >> shift) & 255) + 1] += 1;
+    if (offsets[((keys.front() >> shift) & 255) + 1] == (int)keys.size())
+      continue;
+    for (auto digit = 0; digit < 256; digit++)
+      offsets[digit + 1] += offsets[digit];
+    for (auto idx : order) sorted[offsets[(keys[idx] >> shift) & 255]++] = idx;
+    std::swap(order, sorted);
+  }
+  return order;
+}
+
+// Splits a BVH node using the SAH heuristic. Primitives are binned by
+// center in a single pass, then the cost of every split between bins is
+// computed with a prefix and a suffix sweep. Returns split position and axis.
 static pair<int, int> split_sah(vector<int>& primitives,
     const vector<bbox3f>& bboxes, const vector<vec3f>& centers, int start,
     int end) {
@@ -324,35 +632,62 @@ static pair<int, int> split_sah(vector<int>& primitives,
   auto csize = cbbox.max - cbbox.min;
   if (csize == vec3f{0, 0, 0}) return {(start + end) / 2, 0};
 
-  // consider N bins, compute their cost and keep the minimum
-  auto      axis      = 0;
-  const int nbins     = 16;
-  auto      split     = 0.0f;
-  auto      min_cost  = flt_max;
-  auto      bbox_area = [](const bbox3f& b) {
+  // bin index of a center along an axis
+  const int nbins   = 16;
+  auto      get_bin = [&](const vec3f& center, int axis) {
+    auto bin = (int)(nbins * (center[axis] - cbbox.min[axis]) / csize[axis]);
+    return clamp(bin, 0, nbins - 1);
+  };
+
+  // fill bins for all axes at once
+  auto bins_bbox  = array<array<bbox3f, nbins>, 3>{};
+  auto bins_count = array<array<int, nbins>, 3>{};
+  for (auto axis = 0; axis < 3; axis++) {
+    bins_bbox[axis].fill(invalidb3f);
+    bins_count[axis].fill(0);
+  }
+  for (auto i = start; i < end; i++) {
+    auto& center = centers[primitives[i]];
+    auto& bbox   = bboxes[primitives[i]];
+    for (auto axis = 0; axis < 3; axis++) {
+      if (csize[axis] == 0) continue;
+      auto bin              = get_bin(center, axis);
+      bins_bbox[axis][bin]  = merge(bins_bbox[axis][bin], bbox);
+      bins_count[axis][bin] += 1;
+    }
+  }
+
+  // consider the splits between bins, compute their cost and keep the minimum
+  auto axis      = 0;
+  auto split     = 0;
+  auto min_cost  = flt_max;
+  auto bbox_area = [](const bbox3f& b) {
     auto size = b.max - b.min;
     return 1e-12f + 2 * size.x * size.y + 2 * size.x * size.z +
            2 * size.y * size.z;
   };
   for (auto saxis = 0; saxis < 3; saxis++) {
+    if (csize[saxis] == 0) continue;
+    // right side costs, swept from the last bin
+    auto right_costs = array<float, nbins>{};
+    auto right_bbox  = invalidb3f;
+    auto right_count = 0;
+    for (auto b = nbins - 1; b > 0; b--) {
+      right_bbox = merge(right_bbox, bins_bbox[saxis][b]);
+      right_count += bins_count[saxis][b];
+      right_costs[b] = right_count * bbox_area(right_bbox);
+    }
+    // left side costs, swept from the first bin
+    auto left_bbox  = invalidb3f;
+    auto left_count = 0;
     for (auto b = 1; b < nbins; b++) {
-      auto bsplit    = cbbox.min[saxis] + b * csize[saxis] / nbins;
-      auto left_bbox = invalidb3f, right_bbox = invalidb3f;
-      auto left_nprims = 0, right_nprims = 0;
-      for (auto i = start; i < end; i++) {
-        if (centers[primitives[i]][saxis] < bsplit) {
-          left_bbox = merge(left_bbox, bboxes[primitives[i]]);
-          left_nprims += 1;
-        } else {
-          right_bbox = merge(right_bbox, bboxes[primitives[i]]);
-          right_nprims += 1;
-        }
-      }
-      auto cost = 1 + left_nprims * bbox_area(left_bbox) / bbox_area(cbbox) +
-                  right_nprims * bbox_area(right_bbox) / bbox_area(cbbox);
+      left_bbox = merge(left_bbox, bins_bbox[saxis][b - 1]);
+      left_count += bins_count[saxis][b - 1];
+      auto cost = 1 + (left_count * bbox_area(left_bbox) + right_costs[b]) /
+                          bbox_area(cbbox);
       if (cost < min_cost) {
         min_cost = cost;
-        split    = bsplit;
+        split    = b;
         axis     = saxis;
       }
     }
@@ -360,8 +695,8 @@ static pair<int, int> split_sah(vector<int>& primitives,
   // split
   auto middle =
       (int)(std::partition(primitives.data() + start, primitives.data() + end,
-                [axis, split, &centers](auto primitive) {
-                  return centers[primitive][axis] < split;
+                [axis, split, &centers, &get_bin](auto primitive) {
+                  return get_bin(centers[primitive], axis) < split;
                 }) -
             primitives.data());
 
@@ -440,28 +775,55 @@ static pair<int, int> split_middle(vector<int>& primitives,
   return {middle, axis};
 }
 
-// Maximum number of primitives per BVH node.
-const int bvh_max_prims = 4;
-
-// Build BVH nodes
-static void build_bvh(
-    bvh_data& bvh, const vector<bbox3f>& bboxes, bool highquality) {
-  // prepare to build nodes
-  bvh.nodes.clear();
-  bvh.nodes.reserve(bboxes.size() * 2);
+// Splits a BVH node whose primitives are sorted by the Morton code of their
+// centers, as in linear BVHs. The split is where the highest bit that differs
+// in the node codes changes, found with a binary search, so primitives are
+// not moved. Primitives with the same code are split in the middle. Returns
+// split position and axis.
+static pair<int, int> split_morton(vector<int>& primitives,
+    const vector<bbox3f>& bboxes, const vector<vec3f>& centers,
+    const vector<uint32_t>& codes, int start, int end) {
+  // same codes are split in space instead, since their order does not matter
+  auto first = codes[primitives[start]], last = codes[primitives[end - 1]];
+  if (first == last)
+    return split_middle(primitives, bboxes, centers, start, end);
+
+  // highest differing bit, which is interleaved with the others by axis
+  auto bit = 31;
+  while ((((first ^ last) >> bit) & 1) == 0) bit--;
+
+  // first primitive with the bit set
+  auto lo = start, hi = end - 1;
+  while (hi - lo > 1) {
+    auto mid = (lo + hi) / 2;
+    if ((codes[primitives[mid]] >> bit) & 1) {
+      hi = mid;
+    } else {
+      lo = mid;
+    }
+  }
 
-  // prepare primitives
-  bvh.primitives.resize(bboxes.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++) bvh.primitives[idx] = idx;
+  // done
+  return {hi, 2 - bit % 3};
+}
 
-  // prepare centers
-  auto centers = vector<vec3f>(bboxes.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++)
-    centers[idx] = center(bboxes[idx]);
+// Maximum number of primitives per BVH node.
+const int bvh_max_prims = 4;
 
+// Number of primitives below which subtrees are built as separate tasks.
+const int bvh_task_prims = 4096;
+
+// Build the nodes of the subtree rooted at nodeid, for the primitives in
+// [start, end). Nodes are appended to `nodes`. When `tasks` is given,
+// subtrees smaller than bvh_task_prims are left as placeholders and
+// returned as tasks instead. When Morton codes are given, primitives are
+// sorted by them and nodes are split with split_morton.
+static void build_bvh(vector<bvh_node>& nodes, vector<int>& primitives,
+    const vector<bbox3f>& bboxes, const vector<vec3f>& centers,
+    const vector<uint32_t>& codes, int nodeid, int start, int end,
+    bool highquality, vector<vec3i>* tasks) {
   // push first node onto the stack
-  auto stack = vector<vec3i>{{0, 0, (int)bboxes.size()}};
-  bvh.nodes.emplace_back();
+  auto stack = vector<vec3i>{{nodeid, start, end}};
 
   // create nodes until the stack is empty
   while (!stack.empty()) {
@@ -469,29 +831,40 @@ static void build_bvh(
     auto [nodeid, start, end] = stack.back();
     stack.pop_back();
 
+    // defer small subtrees
+    if (tasks && end - start <= bvh_task_prims &&
+        end - start > bvh_max_prims) {
+      tasks->push_back({nodeid, start, end});
+      continue;
+    }
+
     // grab node
-    auto& node = bvh.nodes[nodeid];
+    auto& node = nodes[nodeid];
 
-    // compute bounds
+    // compute bounds, or leave them to the caller for linear bvhs
     node.bbox = invalidb3f;
-    for (auto i = start; i < end; i++)
-      node.bbox = merge(node.bbox, bboxes[bvh.primitives[i]]);
+    if (codes.empty()) {
+      for (auto i = start; i < end; i++)
+        node.bbox = merge(node.bbox, bboxes[primitives[i]]);
+    }
 
     // split into two children
     if (end - start > bvh_max_prims) {
       // get split
       auto [mid, axis] =
-          highquality
-              ? split_sah(bvh.primitives, bboxes, centers, start, end)
-              : split_middle(bvh.primitives, bboxes, centers, start, end);
+          !codes.empty()
+              ? split_morton(primitives, bboxes, centers, codes, start, end)
+          : highquality
+              ? split_sah(primitives, bboxes, centers, start, end)
+              : split_middle(primitives, bboxes, centers, start, end);
 
       // make an internal node
       node.internal = true;
       node.axis     = (uint8_t)axis;
       node.num      = 2;
-      node.start    = (int)bvh.nodes.size();
-      bvh.nodes.emplace_back();
-      bvh.nodes.emplace_back();
+      node.start    = (int)nodes.size();
+      nodes.emplace_back();
+      nodes.emplace_back();
       stack.push_back({node.start + 0, start, mid});
       stack.push_back({node.start + 1, mid, end});
     } else {
@@ -501,9 +874,490 @@ static void build_bvh(
       node.start    = start;
     }
   }
+}
+
+// Minimum overlap of the children of an object split, relative to the root
+// area, for which spatial splits are tried.
+const float bvh_spatial_overlap = 1e-5f;
+
+// Maximum growth of the number of primitive references due to spatial splits.
+const float bvh_spatial_growth = 0.5f;
+
+// Split the part of a primitive within a box by an axis-aligned plane,
+// returning the bounds of the parts on the left and on the right of it.
+using bvh_clip = function<pair<bbox3f, bbox3f>(
+    int primitive, const bbox3f& bbox, int axis, float position)>;
+
+// Reference to a primitive in a bvh with spatial splits, with the bounds of
+// the part of the primitive it covers.
+struct bvh_reference {
+  bbox3f bbox      = invalidb3f;
+  int    primitive = -1;
+};
+
+// Split the part of a triangle within a box by an axis-aligned plane. The
+// triangle vertices and the intersections of its edges with the plane are
+// bounded on either side, then the bounds are restricted to the box.
+static pair<bbox3f, bbox3f> clip_triangle(const vec3f& p0, const vec3f& p1,
+    const vec3f& p2, const bbox3f& bbox, int axis, float position) {
+  auto vertices = array<vec3f, 3>{p0, p1, p2};
+  auto left = invalidb3f, right = invalidb3f;
+  for (auto idx = 0; idx < 3; idx++) {
+    auto& a = vertices[idx];
+    auto& b = vertices[(idx + 1) % 3];
+    if (a[axis] <= position) left = merge(left, a);
+    if (a[axis] >= position) right = merge(right, a);
+    if ((a[axis] < position && b[axis] > position) ||
+        (a[axis] > position && b[axis] < position)) {
+      auto p  = a + (b - a) * ((position - a[axis]) / (b[axis] - a[axis]));
+      p[axis] = position;
+      left    = merge(left, p);
+      right   = merge(right, p);
+    }
+  }
+  left.max[axis]  = position;
+  right.min[axis] = position;
+  return {bbox3f{max(left.min, bbox.min), min(left.max, bbox.max)},
+      bbox3f{max(right.min, bbox.min), min(right.max, bbox.max)}};
+}
+
+// Splits the references of a BVH node, as in SBVH. Object splits are found
+// as in split_sah, binning reference centers. When their children overlap,
+// spatial splits are tried too, along the largest axis of the node, binning
+// the references in space and clipping them to the bins. References that
+// straddle a spatial split are split in two. Returns the split axis.
+static int split_spatial(const vector<bvh_reference>& references,
+    const bbox3f& bbox, float root_area, bool spatial, const bvh_clip& clip,
+    vector<bvh_reference>& left, vector<bvh_reference>& right) {
+  const int nbins     = 16;
+  auto      bbox_area = [](const bbox3f& b) {
+    auto size = b.max - b.min;
+    return 1e-12f + 2 * size.x * size.y + 2 * size.x * size.z +
+           2 * size.y * size.z;
+  };
+  auto is_valid = [](const bbox3f& b) {
+    return b.min.x <= b.max.x && b.min.y <= b.max.y && b.min.z <= b.max.z;
+  };
+
+  // object split, binning reference centers
+  auto cbbox = invalidb3f;
+  for (auto& reference : references)
+    cbbox = merge(cbbox, center(reference.bbox));
+  auto csize      = cbbox.max - cbbox.min;
+  auto center_bin = [&](const bvh_reference& reference, int axis) {
+    auto bin = (int)(nbins * (center(reference.bbox)[axis] - cbbox.min[axis]) /
+                     csize[axis]);
+    return clamp(bin, 0, nbins - 1);
+  };
+  auto object_axis = -1, object_split = 0;
+  auto object_cost = flt_max, object_overlap = 0.0f;
+  for (auto axis = 0; axis < 3; axis++) {
+    if (csize[axis] == 0) continue;
+    auto bins_bbox  = array<bbox3f, nbins>{};
+    auto bins_count = array<int, nbins>{};
+    bins_bbox.fill(invalidb3f);
+    for (auto& reference : references) {
+      auto bin        = center_bin(reference, axis);
+      bins_bbox[bin]  = merge(bins_bbox[bin], reference.bbox);
+      bins_count[bin] += 1;
+    }
+    auto right_bboxes = array<bbox3f, nbins>{};
+    auto right_counts = array<int, nbins>{};
+    auto right_bbox   = invalidb3f;
+    auto right_count  = 0;
+    for (auto b = nbins - 1; b > 0; b--) {
+      right_bbox = merge(right_bbox, bins_bbox[b]);
+      right_count += bins_count[b];
+      right_bboxes[b] = right_bbox;
+      right_counts[b] = right_count;
+    }
+    auto left_bbox  = invalidb3f;
+    auto left_count = 0;
+    for (auto b = 1; b < nbins; b++) {
+      left_bbox = merge(left_bbox, bins_bbox[b - 1]);
+      left_count += bins_count[b - 1];
+      if (left_count == 0 || right_counts[b] == 0) continue;
+      auto cost = left_count * bbox_area(left_bbox) +
+                  right_counts[b] * bbox_area(right_bboxes[b]);
+      if (cost < object_cost) {
+        auto overlap = bbox3f{max(left_bbox.min, right_bboxes[b].min),
+            min(left_bbox.max, right_bboxes[b].max)};
+        object_cost    = cost;
+        object_axis    = axis;
+        object_split   = b;
+        object_overlap = is_valid(overlap) ? bbox_area(overlap) : 0;
+      }
+    }
+  }
+
+  // spatial split, binning clipped references between planes
+  auto size  = bbox.max - bbox.min;
+  auto plane = [&](int axis, int b) {
+    return b == nbins ? bbox.max[axis]
+                      : bbox.min[axis] + size[axis] * b / nbins;
+  };
+  auto plane_bin = [&](float value, int axis) {
+    auto bin = (int)(nbins * (value - bbox.min[axis]) / size[axis]);
+    return clamp(bin, 0, nbins - 1);
+  };
+  auto spatial_axis = -1, spatial_split = 0;
+  auto spatial_cost = flt_max;
+  if (spatial && object_overlap > bvh_spatial_overlap * root_area) {
+    for (auto axis = 0; axis < 3; axis++) {
+      if (size[axis] == 0 || size[axis] < max(size)) continue;
+      auto bins_bbox    = array<bbox3f, nbins>{};
+      auto bins_entries = array<int, nbins>{};
+      auto bins_exits   = array<int, nbins>{};
+      bins_bbox.fill(invalidb3f);
+      for (auto& reference : references) {
+        auto first = plane_bin(reference.bbox.min[axis], axis);
+        auto last  = plane_bin(reference.bbox.max[axis], axis);
+        auto bbox  = reference.bbox;
+        for (auto b = first; b < last; b++) {
+          auto [left, right] = clip(
+              reference.primitive, bbox, axis, plane(axis, b + 1));
+          bins_bbox[b] = merge(bins_bbox[b], left);
+          bbox         = right;
+        }
+        bins_bbox[last] = merge(bins_bbox[last], bbox);
+        bins_entries[first] += 1;
+        bins_exits[last] += 1;
+      }
+      auto right_bboxes = array<bbox3f, nbins>{};
+      auto right_counts = array<int, nbins>{};
+      auto right_bbox   = invalidb3f;
+      auto right_count  = 0;
+      for (auto b = nbins - 1; b > 0; b--) {
+        right_bbox = merge(right_bbox, bins_bbox[b]);
+        right_count += bins_exits[b];
+        right_bboxes[b] = right_bbox;
+        right_counts[b] = right_count;
+      }
+      auto left_bbox  = invalidb3f;
+      auto left_count = 0;
+      for (auto b = 1; b < nbins; b++) {
+        left_bbox = merge(left_bbox, bins_bbox[b - 1]);
+        left_count += bins_entries[b - 1];
+        if (left_count == 0 || right_counts[b] == 0) continue;
+        auto cost = left_count * bbox_area(left_bbox) +
+                    right_counts[b] * bbox_area(right_bboxes[b]);
+        if (cost < spatial_cost) {
+          spatial_cost  = cost;
+          spatial_axis  = axis;
+          spatial_split = b;
+        }
+      }
+    }
+  }
+
+  // split references in space, when cheaper
+  left.clear();
+  right.clear();
+  if (spatial_axis >= 0 && spatial_cost < object_cost) {
+    auto axis   = spatial_axis;
+    auto offset = plane(axis, spatial_split);
+    for (auto& reference : references) {
+      auto first = plane_bin(reference.bbox.min[axis], axis);
+      auto last  = plane_bin(reference.bbox.max[axis], axis);
+      if (last < spatial_split) {
+        left.push_back(reference);
+      } else if (first >= spatial_split) {
+        right.push_back(reference);
+      } else {
+        auto [left_bbox, right_bbox] = clip(
+            reference.primitive, reference.bbox, axis, offset);
+        if (is_valid(left_bbox))
+          left.push_back({left_bbox, reference.primitive});
+        if (is_valid(right_bbox))
+          right.push_back({right_bbox, reference.primitive});
+      }
+    }
+    if (!left.empty() && !right.empty()) return axis;
+    left.clear();
+    right.clear();
+  }
+
+  // split objects, or just break the references in half
+  for (auto& reference : references) {
+    if (object_axis >= 0 ? center_bin(reference, object_axis) < object_split
+                         : left.size() < references.size() / 2) {
+      left.push_back(reference);
+    } else {
+      right.push_back(reference);
+    }
+  }
+  return std::max(object_axis, 0);
+}
+
+// Build BVH nodes with spatial splits. Primitives referenced by several
+// leaves are stored once per leaf. The build is serial.
+static void build_sbvh(
+    bvh_data& bvh, const vector<bbox3f>& bboxes, const bvh_clip& clip) {
+  // prepare to build nodes
+  auto& nodes          = bvh.nodes;
+  auto& primitives     = bvh.primitives;
+  auto  max_references = (int)(bboxes.size() * (1 + bvh_spatial_growth));
+  nodes.clear();
+  nodes.reserve(max_references * 2);
+  primitives.clear();
+  primitives.reserve(max_references);
+
+  // prepare references
+  auto references = vector<bvh_reference>(bboxes.size());
+  for (auto idx = 0; idx < bboxes.size(); idx++)
+    references[idx] = {bboxes[idx], idx};
+  auto num_references = (int)references.size();
+
+  // push first node onto the stack
+  auto stack = vector<pair<int, vector<bvh_reference>>>{};
+  nodes.emplace_back();
+  stack.push_back({0, std::move(references)});
+
+  // create nodes until the stack is empty
+  auto root_area = 0.0f;
+  while (!stack.empty()) {
+    // grab node to work on
+    auto [nodeid, references] = std::move(stack.back());
+    stack.pop_back();
+
+    // compute bounds
+    auto bbox = invalidb3f;
+    for (auto& reference : references) bbox = merge(bbox, reference.bbox);
+    nodes[nodeid].bbox = bbox;
+    if (nodeid == 0) {
+      auto size = bbox.max - bbox.min;
+      root_area = 2 * size.x * size.y + 2 * size.x * size.z +
+                  2 * size.y * size.z;
+    }
+
+    // make a leaf node
+    if (references.size() <= bvh_max_prims) {
+      auto& node    = nodes[nodeid];
+      node.internal = false;
+      node.num      = (int16_t)references.size();
+      node.start    = (int)primitives.size();
+      for (auto& reference : references)
+        primitives.push_back(reference.primitive);
+      continue;
+    }
+
+    // split into two children
+    auto left = vector<bvh_reference>{}, right = vector<bvh_reference>{};
+    auto axis = split_spatial(references, bbox, root_area,
+        num_references < max_references, clip, left, right);
+    num_references += (int)(left.size() + right.size() - references.size());
+
+    // make an internal node
+    auto start = (int)nodes.size();
+    nodes.emplace_back();
+    nodes.emplace_back();
+    auto& node    = nodes[nodeid];
+    node.internal = true;
+    node.axis     = (uint8_t)axis;
+    node.num      = 2;
+    node.start    = start;
+    stack.push_back({start + 0, std::move(left)});
+    stack.push_back({start + 1, std::move(right)});
+  }
+
+  // cleanup
+  nodes.shrink_to_fit();
+  primitives.shrink_to_fit();
+}
+
+// Build BVH nodes. The top of the tree is built first, then the remaining
+// subtrees are built in parallel in their own node arrays, which are
+// appended to the tree in order. The tree does not depend on threading.
+// Linear BVHs sort primitives by the Morton code of their centers first, so
+// that nodes are split without looking at bounds, trading tree quality for
+// build speed. Spatial splits are used if requested and primitives can be
+// clipped.
+static void build_bvh(bvh_data& bvh, const vector<bbox3f>& bboxes,
+    const bvh_params& params, const bvh_clip& clip = {}) {
+  // spatial splits
+  if (params.spatial && clip) {
+    build_sbvh(bvh, bboxes, clip);
+    return;
+  }
+
+  // prepare to build nodes
+  auto& nodes      = bvh.nodes;
+  auto& primitives = bvh.primitives;
+  nodes.clear();
+  nodes.reserve(bboxes.size() * 2);
+
+  // prepare primitives
+  primitives.resize(bboxes.size());
+  for (auto idx = 0; idx < bboxes.size(); idx++) primitives[idx] = idx;
+
+  // prepare centers
+  auto centers = vector<vec3f>(bboxes.size());
+  for (auto idx = 0; idx < bboxes.size(); idx++)
+    centers[idx] = center(bboxes[idx]);
+
+  // sort primitives by the Morton codes of their centers
+  auto codes = vector<uint32_t>{};
+  if (params.linear) {
+    auto cbbox = invalidb3f;
+    for (auto& center : centers) cbbox = merge(cbbox, center);
+    codes.resize(centers.size());
+    auto make_code = [&](size_t idx) {
+      codes[idx] = morton_code(centers[idx], cbbox);
+    };
+    if (params.noparallel) {
+      for (auto idx = (size_t)0; idx < codes.size(); idx++) make_code(idx);
+    } else {
+      parallel_for(codes.size(), make_code);
+    }
+    primitives = sort_keys(codes);
+  }
+
+  // build the top of the tree
+  auto tasks = vector<vec3i>{};
+  nodes.emplace_back();
+  build_bvh(nodes, primitives, bboxes, centers, codes, 0, 0,
+      (int)bboxes.size(), params.highquality, &tasks);
+
+  // build subtrees, each with its root at index 0
+  auto subtrees   = vector<vector<bvh_node>>(tasks.size());
+  auto build_task = [&](size_t idx) {
+    auto [nodeid, start, end] = tasks[idx];
+    subtrees[idx].reserve((end - start) * 2);
+    subtrees[idx].emplace_back();
+    build_bvh(subtrees[idx], primitives, bboxes, centers, codes, 0, start,
+        end, params.highquality, nullptr);
+  };
+  if (params.noparallel || tasks.size() <= 1) {
+    for (auto idx = (size_t)0; idx < tasks.size(); idx++) build_task(idx);
+  } else {
+    parallel_for(tasks.size(), build_task);
+  }
+
+  // splice subtrees, replacing their placeholder with their root
+  for (auto idx = 0; idx < (int)tasks.size(); idx++) {
+    auto& subtree = subtrees[idx];
+    auto  offset  = (int)nodes.size() - 1;
+    for (auto& node : subtree) {
+      if (node.internal) node.start += offset;
+    }
+    nodes[tasks[idx].x] = subtree[0];
+    nodes.insert(nodes.end(), subtree.begin() + 1, subtree.end());
+  }
+
+  // compute the bounds of linear bvhs bottom up, since children follow parents
+  if (!codes.empty()) {
+    for (auto nodeid = (int)nodes.size() - 1; nodeid >= 0; nodeid--) {
+      auto& node = nodes[nodeid];
+      if (node.internal) {
+        node.bbox = merge(
+            nodes[node.start + 0].bbox, nodes[node.start + 1].bbox);
+      } else {
+        for (auto idx = 0; idx < node.num; idx++)
+          node.bbox = merge(node.bbox, bboxes[primitives[node.start + idx]]);
+      }
+    }
+  }
+
+  // cleanup
+  nodes.shrink_to_fit();
+}
+
+// Collapse the binary nodes into 4-wide nodes. Each wide node replaces a
+// binary subtree, whose largest internal nodes are opened until it has four
+// children. Leaves keep their primitive ranges. If requested, the wide node
+// and slot of each binary node that becomes a child are returned, with -1
+// for the others.
+static void collapse_bvh(bvh_data& bvh, vector<vec2i>* slots = nullptr) {
+  // prepare to build nodes
+  bvh.wide_nodes.clear();
+  if (slots) slots->assign(bvh.nodes.size(), {-1, -1});
+  if (bvh.nodes.empty()) return;
+  bvh.wide_nodes.reserve(bvh.nodes.size() / 2 + 1);
+
+  // area used to pick the children to open
+  auto bbox_area = [](const bbox3f& b) {
+    auto size = b.max - b.min;
+    return size.x * size.y + size.x * size.z + size.y * size.z;
+  };
+
+  // push first node onto the stack, with the binary node it replaces
+  auto stack = vector<pair<int, int>>{{0, 0}};
+  bvh.wide_nodes.emplace_back();
+
+  // create nodes until the stack is empty
+  while (!stack.empty()) {
+    // grab node to work on
+    auto [wideid, nodeid] = stack.back();
+    stack.pop_back();
+
+    // gather children by opening the largest internal ones
+    auto children = array<int, 4>{nodeid, 0, 0, 0};
+    auto count    = 1;
+    while (count < 4) {
+      auto best = -1;
+      for (auto idx = 0; idx < count; idx++) {
+        auto& child = bvh.nodes[children[idx]];
+        if (!child.internal) continue;
+        if (best < 0 || bbox_area(child.bbox) >
+                            bbox_area(bvh.nodes[children[best]].bbox))
+          best = idx;
+      }
+      if (best < 0) break;
+      auto& node        = bvh.nodes[children[best]];
+      children[best]    = node.start + 0;
+      children[count++] = node.start + 1;
+    }
+
+    // fill the wide node
+    auto wide  = bvh_node4{};
+    wide.count = (int8_t)count;
+    for (auto idx = 0; idx < count; idx++) {
+      auto& child = bvh.nodes[children[idx]];
+      for (auto axis = 0; axis < 3; axis++) {
+        wide.min[axis][idx] = child.bbox.min[axis];
+        wide.max[axis][idx] = child.bbox.max[axis];
+      }
+      if (slots) (*slots)[children[idx]] = {wideid, idx};
+      if (child.internal) {
+        wide.internal[idx] = true;
+        wide.start[idx]    = (int)bvh.wide_nodes.size();
+        bvh.wide_nodes.emplace_back();
+        stack.push_back({wide.start[idx], children[idx]});
+      } else {
+        wide.internal[idx] = false;
+        wide.start[idx]    = child.start;
+        wide.num[idx]      = child.num;
+      }
+    }
+    bvh.wide_nodes[wideid] = wide;
+  }
 
   // cleanup
-  bvh.nodes.shrink_to_fit();
+  bvh.wide_nodes.shrink_to_fit();
+}
+
+// Store the triangles, or quads, of a shape in leaf order, so that a leaf
+// reads a single contiguous block. Quads take two slots, the second of which
+// is degenerate for quads that are triangles.
+static void make_triangles(bvh_data& bvh, const shape_data& shape) {
+  bvh.triangles.clear();
+  if (!shape.triangles.empty()) {
+    bvh.triangles.resize(bvh.primitives.size());
+    for (auto idx = 0; idx < bvh.primitives.size(); idx++) {
+      auto& t = shape.triangles[bvh.primitives[idx]];
+      auto& p = shape.positions;
+      bvh.triangles[idx] = {p[t.x], p[t.y] - p[t.x], p[t.z] - p[t.x]};
+    }
+  } else if (!shape.quads.empty()) {
+    bvh.triangles.resize(bvh.primitives.size() * 2);
+    for (auto idx = 0; idx < bvh.primitives.size(); idx++) {
+      auto& q = shape.quads[bvh.primitives[idx]];
+      auto& p = shape.positions;
+      bvh.triangles[idx * 2 + 0] = {p[q.x], p[q.y] - p[q.x], p[q.w] - p[q.x]};
+      bvh.triangles[idx * 2 + 1] = {p[q.z], p[q.w] - p[q.z], p[q.y] - p[q.z]};
+    }
+  }
+  bvh.triangles.shrink_to_fit();
 }
 
 // Update bvh
@@ -521,18 +1375,51 @@ static void refit_bvh(bvh_data& bvh, const vector<bbox3f>& bboxes) {
       }
     }
   }
+
+  // the wide nodes are rebuilt from the refitted ones
+  if (!bvh.wide_nodes.empty()) collapse_bvh(bvh);
 }
 
-bvh_data make_bvh(const shape_data& shape, bool highquality, bool embree) {
-  // embree
-#ifdef YOCTO_EMBREE
-  if (embree) return make_embree_bvh(shape, highquality);
-#endif
+// Surface area of a bounding box, or zero if the box is empty.
+static double bvh_area(const bbox3f& bbox) {
+  if (bbox.min.x > bbox.max.x) return 0;
+  auto size = bbox.max - bbox.min;
+  return 2 * ((double)size.x * size.y + (double)size.x * size.z +
+                 (double)size.y * size.z);
+}
 
-  // bvh
-  auto bvh = bvh_data{};
+// SAH cost of a node, as its area times the number of tests it leads to.
+static double bvh_cost(const bvh_node& node) {
+  return bvh_area(node.bbox) * (node.internal ? 1 : node.num);
+}
 
-  // build primitives
+// SAH cost of a bvh, relative to the area of its root.
+static double bvh_cost(const bvh_data& bvh) {
+  auto area = bvh.nodes.empty() ? 0 : bvh_area(bvh.nodes[0].bbox);
+  return area > 0 ? bvh.cost / area : 0;
+}
+
+// Link the nodes of an instance bvh to their parents and the instances to
+// their leaves, and compute its cost, for incremental refits.
+static void link_bvh(bvh_data& bvh, int num_instances) {
+  bvh.parents.assign(bvh.nodes.size(), -1);
+  bvh.leaves.assign(num_instances, -1);
+  bvh.cost = 0;
+  for (auto nodeid = 0; nodeid < (int)bvh.nodes.size(); nodeid++) {
+    auto& node = bvh.nodes[nodeid];
+    if (node.internal) {
+      for (auto idx = 0; idx < 2; idx++) bvh.parents[node.start + idx] = nodeid;
+    } else {
+      for (auto idx = 0; idx < node.num; idx++)
+        bvh.leaves[bvh.primitives[node.start + idx]] = nodeid;
+    }
+    bvh.cost += bvh_cost(node);
+  }
+  bvh.build_cost = bvh_cost(bvh);
+}
+
+// Bounds of the elements of a shape.
+static vector<bbox3f> make_bboxes(const shape_data& shape) {
   auto bboxes = vector<bbox3f>{};
   if (!shape.points.empty()) {
     bboxes = vector<bbox3f>(shape.points.size());
@@ -563,96 +1450,262 @@ bvh_data make_bvh(const shape_data& shape, bool highquality, bool embree) {
           shape.positions[quad.w]);
     }
   }
-
-  // build nodes
-  build_bvh(bvh, bboxes, highquality);
-
-  // done
-  return bvh;
+  return bboxes;
 }
 
-bvh_data make_bvh(
-    const scene_data& scene, bool highquality, bool embree, bool noparallel) {
+bvh_data make_bvh(const shape_data& shape, const bvh_params& params) {
   // embree
 #ifdef YOCTO_EMBREE
-  if (embree) return make_embree_bvh(scene, highquality, noparallel);
+  if (params.embree) return make_embree_bvh(shape, params.highquality);
 #endif
 
   // bvh
   auto bvh = bvh_data{};
 
-  // build shape bvh
-  bvh.shapes.resize(scene.shapes.size());
-  if (noparallel) {
-    for (auto idx = (size_t)0; idx < scene.shapes.size(); idx++) {
-      bvh.shapes[idx] = make_bvh(scene.shapes[idx], highquality, embree);
-    }
-  } else {
-    parallel_for(scene.shapes.size(), [&](size_t idx) {
-      bvh.shapes[idx] = make_bvh(scene.shapes[idx], highquality, embree);
-    });
+  // cached bvh
+  auto hash           = params.cache.empty() ? 0 : bvh_hash(shape, params);
+  auto cache_filename = params.cache.empty()
+                            ? string{}
+                            : bvh_cache_filename(params.cache, hash);
+  if (!cache_filename.empty()) {
+    auto error = string{};
+    if (load_bvh(cache_filename, bvh, hash, error)) return bvh;
   }
 
-  // instance bboxes
-  auto bboxes = vector<bbox3f>(scene.instances.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++) {
-    auto& instance = scene.instances[idx];
-    auto& sbvh     = bvh.shapes[instance.shape];
-    bboxes[idx]    = sbvh.nodes.empty()
-                         ? invalidb3f
-                         : transform_bbox(instance.frame, sbvh.nodes[0].bbox);
+  // build primitives
+  auto bboxes = make_bboxes(shape);
+
+  // clip triangles and quads for spatial splits
+  auto clip = bvh_clip{};
+  if (!shape.triangles.empty()) {
+    clip = [&shape](int primitive, const bbox3f& bbox, int axis,
+               float position) {
+      auto& t = shape.triangles[primitive];
+      auto& p = shape.positions;
+      return clip_triangle(p[t.x], p[t.y], p[t.z], bbox, axis, position);
+    };
+  } else if (!shape.quads.empty()) {
+    clip = [&shape](int primitive, const bbox3f& bbox, int axis,
+               float position) {
+      auto& q       = shape.quads[primitive];
+      auto& p       = shape.positions;
+      auto [l1, r1] = clip_triangle(
+          p[q.x], p[q.y], p[q.w], bbox, axis, position);
+      auto [l2, r2] = clip_triangle(
+          p[q.z], p[q.w], p[q.y], bbox, axis, position);
+      return pair{merge(l1, l2), merge(r1, r2)};
+    };
   }
 
   // build nodes
-  build_bvh(bvh, bboxes, highquality);
+  build_bvh(bvh, bboxes, params, clip);
+  if (params.wide) collapse_bvh(bvh);
+  if (params.triangles) make_triangles(bvh, shape);
+
+  // save to cache, building again next time on failure
+  if (!cache_filename.empty()) {
+    auto error = string{};
+    auto ec    = std::error_code{};
+    std::filesystem::create_directories(
+        std::filesystem::u8path(params.cache), ec);
+    save_bvh(cache_filename, bvh, hash, error);
+  }
 
   // done
   return bvh;
 }
 
-static void refit_bvh(bvh_data& bvh, const shape_data& shape) {
-#ifdef YOCTO_EMBREE
-  if (bvh.embree_bvh) {
-    throw std::runtime_error("embree shape refit not supported");
+// Lazy build state of the shape bvhs of a scene, which owns the shape bvhs.
+// Each shape is built once, under its own lock, by the first ray that
+// reaches it or by the pool tasks that warm the shapes in order. Until then,
+// shapes are bounded by their elements. Warming tasks are counted, so that
+// they can be stopped and waited for before the state goes away.
+struct bvh_lazy {
+  const scene_data*         scene   = nullptr;
+  vector<bvh_data>          shapes  = {};
+  bvh_params                params  = {};
+  vector<bbox3f>            bounds  = {};
+  vector<std::atomic<bool>> built   = {};
+  vector<std::mutex>        locks   = {};
+  std::atomic<int>          next    = 0;
+  std::atomic<bool>         stop    = false;
+  int                       warming = 0;
+  std::mutex                mutex;
+  std::condition_variable   done;
+
+  ~bvh_lazy();
+};
+
+// Build a shape bvh of a lazy scene bvh, unless already built.
+static void build_lazy(bvh_lazy& lazy, int shape) {
+  if (lazy.built[shape].load(std::memory_order_acquire)) return;
+  auto lock = std::lock_guard{lazy.locks[shape]};
+  if (lazy.built[shape].load(std::memory_order_relaxed)) return;
+  lazy.shapes[shape] = make_bvh(lazy.scene->shapes[shape], lazy.params);
+  lazy.built[shape].store(true, std::memory_order_release);
+}
+
+// Warm the next shape of a lazy scene bvh in a pool task, then queue the
+// task again behind the other work of the pool, so that warming does not
+// hold workers that rendering needs.
+static void warm_lazy(bvh_lazy& lazy) {
+  auto shape = lazy.stop ? (int)lazy.built.size() : lazy.next++;
+  if (shape < (int)lazy.built.size()) {
+    build_lazy(lazy, shape);
+    get_thread_pool().push([&lazy]() { warm_lazy(lazy); });
+    return;
   }
-#endif
+  // notify under the lock, since the state may be destroyed once unlocked
+  auto lock = std::lock_guard{lazy.mutex};
+  lazy.warming -= 1;
+  lazy.done.notify_all();
+}
 
-  // build primitives
-  auto bboxes = vector<bbox3f>{};
-  if (!shape.points.empty()) {
-    bboxes = vector<bbox3f>(shape.points.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& p     = shape.points[idx];
-      bboxes[idx] = point_bounds(shape.positions[p], shape.radius[p]);
-    }
-  } else if (!shape.lines.empty()) {
-    bboxes = vector<bbox3f>(shape.lines.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& l     = shape.lines[idx];
-      bboxes[idx] = line_bounds(shape.positions[l.x], shape.positions[l.y],
-          shape.radius[l.x], shape.radius[l.y]);
-    }
-  } else if (!shape.triangles.empty()) {
-    bboxes = vector<bbox3f>(shape.triangles.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& t     = shape.triangles[idx];
-      bboxes[idx] = triangle_bounds(
-          shape.positions[t.x], shape.positions[t.y], shape.positions[t.z]);
+// Stop warming the shapes of a lazy scene bvh, waiting for the running
+// warming tasks.
+static void stop_lazy(bvh_lazy& lazy) {
+  lazy.stop = true;
+  auto lock = std::unique_lock{lazy.mutex};
+  lazy.done.wait(lock, [&lazy]() { return lazy.warming == 0; });
+}
+
+bvh_lazy::~bvh_lazy() { stop_lazy(*this); }
+
+// Get the bvhs of the shapes, which lazy bvhs keep in their lazy state.
+static vector<bvh_data>& get_shape_bvhs(bvh_data& bvh) {
+  return bvh.lazy ? bvh.lazy->shapes : bvh.shapes;
+}
+static const vector<bvh_data>& get_shape_bvhs(const bvh_data& bvh) {
+  return bvh.lazy ? bvh.lazy->shapes : bvh.shapes;
+}
+
+// Get the bvh of a shape, building it first for lazy bvhs.
+static const bvh_data& get_shape_bvh(const bvh_data& bvh, int shape) {
+  if (bvh.lazy) build_lazy(*bvh.lazy, shape);
+  return get_shape_bvhs(bvh)[shape];
+}
+
+// Get the bounds of a shape, from its bvh or, if not built, its elements.
+static bbox3f get_shape_bbox(const bvh_data& bvh, int shape) {
+  if (bvh.lazy && !bvh.lazy->built[shape].load(std::memory_order_acquire))
+    return bvh.lazy->bounds[shape];
+  auto& sbvh = get_shape_bvhs(bvh)[shape];
+  return sbvh.nodes.empty() ? invalidb3f : sbvh.nodes[0].bbox;
+}
+
+// Get the bounds of an instance.
+static bbox3f get_instance_bbox(
+    const bvh_data& bvh, const scene_data& scene, int instance_) {
+  auto& instance = scene.instances[instance_];
+  auto  bbox     = get_shape_bbox(bvh, instance.shape);
+  return bbox.min.x <= bbox.max.x ? transform_bbox(instance.frame, bbox)
+                                  : invalidb3f;
+}
+
+bvh_data make_bvh(const scene_data& scene, const bvh_params& params) {
+  // embree
+#ifdef YOCTO_EMBREE
+  if (params.embree)
+    return make_embree_bvh(scene, params.highquality, params.noparallel);
+#endif
+
+  // bvh
+  auto bvh = bvh_data{};
+
+  // build shape bvh, or only their bounds for lazy bvhs, whose shapes are
+  // built serially since rays reach them from rendering threads
+  if (params.lazy) {
+    bvh.lazy               = std::make_shared<bvh_lazy>();
+    auto& lazy             = *bvh.lazy;
+    lazy.scene             = &scene;
+    lazy.shapes            = vector<bvh_data>(scene.shapes.size());
+    lazy.params            = params;
+    lazy.params.noparallel = true;
+    lazy.bounds = vector<bbox3f>(scene.shapes.size(), invalidb3f);
+    lazy.built  = vector<std::atomic<bool>>(scene.shapes.size());
+    lazy.locks  = vector<std::mutex>(scene.shapes.size());
+  } else {
+    bvh.shapes.resize(scene.shapes.size());
+  }
+  auto build_shape = [&](size_t idx) {
+    if (bvh.lazy) {
+      for (auto& bbox : make_bboxes(scene.shapes[idx]))
+        bvh.lazy->bounds[idx] = merge(bvh.lazy->bounds[idx], bbox);
+    } else {
+      bvh.shapes[idx] = make_bvh(scene.shapes[idx], params);
     }
-  } else if (!shape.quads.empty()) {
-    bboxes = vector<bbox3f>(shape.quads.size());
-    for (auto idx = 0; idx < bboxes.size(); idx++) {
-      auto& q     = shape.quads[idx];
-      bboxes[idx] = quad_bounds(shape.positions[q.x], shape.positions[q.y],
-          shape.positions[q.z], shape.positions[q.w]);
+  };
+  if (params.noparallel) {
+    for (auto idx = (size_t)0; idx < scene.shapes.size(); idx++) {
+      build_shape(idx);
     }
+  } else {
+    parallel_for(scene.shapes.size(), build_shape);
+  }
+
+  // instance inverse frames
+  bvh.inverse_frames.resize(scene.instances.size());
+  for (auto idx = 0; idx < bvh.inverse_frames.size(); idx++) {
+    bvh.inverse_frames[idx] = inverse(scene.instances[idx].frame, true);
+  }
+
+  // instance bboxes
+  auto bboxes = vector<bbox3f>(scene.instances.size());
+  for (auto idx = 0; idx < bboxes.size(); idx++) {
+    bboxes[idx] = get_instance_bbox(bvh, scene, idx);
   }
 
+  // build nodes
+  build_bvh(bvh, bboxes, params);
+  if (params.wide) collapse_bvh(bvh, &bvh.wide_slots);
+
+  // prepare for refits
+  link_bvh(bvh, (int)scene.instances.size());
+  bvh.params = params;
+
+  // warm lazy shapes in the background, on up to half of the pool workers
+  if (bvh.lazy && !params.noparallel) {
+    auto& lazy    = *bvh.lazy;
+    auto& pool    = get_thread_pool();
+    auto  warmers = std::min(std::max(pool.size() / 2, 1), pool.size());
+    lazy.warming  = warmers;
+    pool.push([&lazy]() { warm_lazy(lazy); }, warmers);
+  }
+
+  // done
+  return bvh;
+}
+
+bvh_data make_bvh(const shape_data& shape, bool highquality, bool embree) {
+  return make_bvh(shape, bvh_params{highquality, embree});
+}
+bvh_data make_bvh(
+    const scene_data& scene, bool highquality, bool embree, bool noparallel) {
+  return make_bvh(scene, bvh_params{highquality, embree, noparallel});
+}
+
+static void refit_bvh(bvh_data& bvh, const shape_data& shape) {
+#ifdef YOCTO_EMBREE
+  if (bvh.embree_bvh) {
+    throw std::runtime_error("embree shape refit not supported");
+  }
+#endif
+
+  // build primitives
+  auto bboxes = make_bboxes(shape);
+
   // update nodes
   refit_bvh(bvh, bboxes);
+
+  // update triangles
+  if (!bvh.triangles.empty()) make_triangles(bvh, shape);
 }
 
-void refit_bvh(bvh_data& bvh, const scene_data& scene,
+// Refit an instance bvh after the given instances changed. Only the nodes
+// on the paths from their leaves to the root are refitted, deepest first,
+// since children follow their parents. The bvh is rebuilt instead when its
+// cost has grown too much.
+static void refit_bvh(bvh_data& bvh, const scene_data& scene,
     const vector<int>& updated_instances) {
 #ifdef YOCTO_EMBREE
   if (bvh.embree_bvh) {
@@ -660,16 +1713,66 @@ void refit_bvh(bvh_data& bvh, const scene_data& scene,
   }
 #endif
 
-  // build primitives
-  auto bboxes = vector<bbox3f>(scene.instances.size());
-  for (auto idx = 0; idx < bboxes.size(); idx++) {
-    auto& instance = scene.instances[idx];
-    auto& sbvh     = bvh.shapes[instance.shape];
-    bboxes[idx]    = transform_bbox(instance.frame, sbvh.nodes[0].bbox);
+  // update inverse frames
+  for (auto instance : updated_instances) {
+    bvh.inverse_frames[instance] = inverse(
+        scene.instances[instance].frame, true);
   }
 
-  // update nodes
-  refit_bvh(bvh, bboxes);
+  // gather the nodes above the updated instances, deepest first, or all
+  // nodes when most of them would be gathered anyway
+  auto nodes = vector<int>{};
+  if (updated_instances.size() * 8 < scene.instances.size()) {
+    for (auto instance : updated_instances) {
+      auto nodeid = bvh.leaves[instance];
+      while (nodeid >= 0) {
+        nodes.push_back(nodeid);
+        nodeid = bvh.parents[nodeid];
+      }
+    }
+    std::sort(nodes.begin(), nodes.end(), std::greater<int>{});
+    nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+  } else {
+    nodes.resize(bvh.nodes.size());
+    for (auto idx = 0; idx < (int)nodes.size(); idx++)
+      nodes[idx] = (int)nodes.size() - 1 - idx;
+  }
+
+  // update nodes, their cost and their wide slots
+  for (auto nodeid : nodes) {
+    auto& node = bvh.nodes[nodeid];
+    bvh.cost -= bvh_cost(node);
+    node.bbox = invalidb3f;
+    if (node.internal) {
+      for (auto idx = 0; idx < 2; idx++) {
+        node.bbox = merge(node.bbox, bvh.nodes[node.start + idx].bbox);
+      }
+    } else {
+      for (auto idx = 0; idx < node.num; idx++) {
+        auto instance = bvh.primitives[node.start + idx];
+        node.bbox     = merge(
+            node.bbox, get_instance_bbox(bvh, scene, instance));
+      }
+    }
+    bvh.cost += bvh_cost(node);
+    if (!bvh.wide_slots.empty() && bvh.wide_slots[nodeid].x >= 0) {
+      auto [wideid, slot] = bvh.wide_slots[nodeid];
+      for (auto axis = 0; axis < 3; axis++) {
+        bvh.wide_nodes[wideid].min[axis][slot] = node.bbox.min[axis];
+        bvh.wide_nodes[wideid].max[axis][slot] = node.bbox.max[axis];
+      }
+    }
+  }
+
+  // rebuild when refits degraded the bvh too much
+  if (bvh_cost(bvh) > bvh.build_cost * bvh.params.rebuild) {
+    auto bboxes = vector<bbox3f>(scene.instances.size());
+    for (auto idx = 0; idx < (int)bboxes.size(); idx++)
+      bboxes[idx] = get_instance_bbox(bvh, scene, idx);
+    build_bvh(bvh, bboxes, bvh.params);
+    if (bvh.params.wide) collapse_bvh(bvh, &bvh.wide_slots);
+    link_bvh(bvh, (int)scene.instances.size());
+  }
 }
 
 void update_bvh(bvh_data& bvh, const shape_data& shape) {
@@ -679,13 +1782,307 @@ void update_bvh(bvh_data& bvh, const shape_data& shape) {
 
 void update_bvh(bvh_data& bvh, const scene_data& scene,
     const vector<int>& updated_instances, const vector<int>& updated_shapes) {
-  // update shapes
-  for (auto shape : updated_shapes) {
-    refit_bvh(bvh.shapes[shape], scene.shapes[shape]);
+  // stop warming lazy shapes, since they may be edited
+  if (bvh.lazy) stop_lazy(*bvh.lazy);
+
+  // update shapes, or only the bounds of lazy shapes not built yet
+  auto refit_shape = [&](size_t idx) {
+    auto shape = updated_shapes[idx];
+    if (bvh.lazy && !bvh.lazy->built[shape]) {
+      auto& bounds = bvh.lazy->bounds[shape];
+      bounds       = invalidb3f;
+      for (auto& bbox : make_bboxes(scene.shapes[shape]))
+        bounds = merge(bounds, bbox);
+    } else {
+      refit_bvh(get_shape_bvhs(bvh)[shape], scene.shapes[shape]);
+    }
+  };
+  if (bvh.params.noparallel || updated_shapes.size() <= 1) {
+    for (auto idx = (size_t)0; idx < updated_shapes.size(); idx++)
+      refit_shape(idx);
+  } else {
+    parallel_for(updated_shapes.size(), refit_shape);
   }
 
-  // handle instances
-  refit_bvh(bvh, scene, updated_instances);
+  // handle instances, including the ones of updated shapes
+  auto instances = updated_instances;
+  if (!updated_shapes.empty()) {
+    auto updated = vector<bool>(scene.shapes.size(), false);
+    for (auto shape : updated_shapes) updated[shape] = true;
+    for (auto idx = 0; idx < (int)scene.instances.size(); idx++) {
+      if (updated[scene.instances[idx].shape]) instances.push_back(idx);
+    }
+  }
+  refit_bvh(bvh, scene, instances);
+}
+
+// Format a statistic, right aligned, with thousands separators for counts
+// and two decimals for averages.
+static string format_stat(uint64_t num) {
+  auto str = std::to_string(num % 1000);
+  while (num >= 1000) {
+    num /= 1000;
+    while (str.size() % 4 != 3) str = "0" + str;
+    str = std::to_string(num % 1000) + "," + str;
+  }
+  while (str.size() < 20) str = " " + str;
+  return str;
+}
+static string format_stat(double num) {
+  auto buffer = array<char, 64>{};
+  snprintf(buffer.data(), buffer.size(), "%20.2f", num);
+  return buffer.data();
+}
+
+// Tree statistics of a bvh, added to the ones of other bvhs.
+struct bvh_tree_stats {
+  uint64_t         leaves     = 0;
+  uint64_t         primitives = 0;
+  vector<uint64_t> depths     = {};  // number of leaves per depth
+};
+static void add_tree_stats(bvh_tree_stats& stats, const bvh_data& bvh) {
+  if (bvh.nodes.empty()) return;
+  auto stack = vector<vec2i>{{0, 0}};
+  while (!stack.empty()) {
+    auto [nodeid, depth] = stack.back();
+    stack.pop_back();
+    auto& node = bvh.nodes[nodeid];
+    if (node.internal) {
+      stack.push_back({node.start + 0, depth + 1});
+      stack.push_back({node.start + 1, depth + 1});
+    } else {
+      if (depth >= (int)stats.depths.size()) stats.depths.resize(depth + 1);
+      stats.leaves += 1;
+      stats.primitives += node.num;
+      stats.depths[depth] += 1;
+    }
+  }
+}
+
+// SAH cost of a bvh tree, relative to the area of its root.
+static double bvh_tree_cost(const bvh_data& bvh) {
+  if (bvh.nodes.empty()) return 0;
+  auto cost = 0.0;
+  for (auto& node : bvh.nodes) cost += bvh_cost(node);
+  auto area = bvh_area(bvh.nodes[0].bbox);
+  return area > 0 ? cost / area : 0;
+}
+
+// Bvh statistics
+vector<string> bvh_stats(const bvh_data& bvh) {
+  auto& shapes     = get_shape_bvhs(bvh);
+  auto  accumulate = [&bvh, &shapes](const auto& func) -> size_t {
+    auto sum = func(bvh);
+    for (auto idx = 0; idx < (int)shapes.size(); idx++) {
+      if (bvh.lazy && !bvh.lazy->built[idx]) continue;
+      sum += func(shapes[idx]);
+    }
+    return sum;
+  };
+  auto format = [](size_t num) { return format_stat((uint64_t)num); };
+
+  auto nodes = accumulate(
+      [](const bvh_data& bvh) { return bvh.nodes.size() * sizeof(bvh_node); });
+  auto wide_nodes = accumulate([](const bvh_data& bvh) {
+    return bvh.wide_nodes.size() * sizeof(bvh_node4);
+  });
+  auto primitives = accumulate(
+      [](const bvh_data& bvh) { return bvh.primitives.size() * sizeof(int); });
+  auto triangles = accumulate([](const bvh_data& bvh) {
+    return bvh.triangles.size() * sizeof(bvh_triangle);
+  });
+  auto frames = bvh.inverse_frames.size() * sizeof(frame3f);
+
+  // tree quality, with the shape costs averaged over the built shapes
+  auto tree        = bvh_tree_stats{};
+  auto shapes_cost = 0.0;
+  auto built       = 0;
+  accumulate([&tree](const bvh_data& bvh) {
+    add_tree_stats(tree, bvh);
+    return (size_t)0;
+  });
+  for (auto idx = 0; idx < (int)shapes.size(); idx++) {
+    if (bvh.lazy && !bvh.lazy->built[idx]) continue;
+    shapes_cost += bvh_tree_cost(shapes[idx]);
+    built += 1;
+  }
+
+  auto stats = vector<string>{};
+  stats.push_back("shapes:       " + format(shapes.size()));
+  stats.push_back("nodes:        " +
+                  format(accumulate([](auto& bvh) { return bvh.nodes.size(); })));
+  stats.push_back("wide nodes:   " + format(accumulate([](auto& bvh) {
+    return bvh.wide_nodes.size();
+  })));
+  stats.push_back("triangles:    " + format(accumulate([](auto& bvh) {
+    return bvh.triangles.size();
+  })));
+  stats.push_back("memory:       " +
+                  format(nodes + wide_nodes + primitives + triangles + frames));
+  stats.push_back("nodes mem:    " + format(nodes));
+  stats.push_back("wide mem:     " + format(wide_nodes));
+  stats.push_back("prims mem:    " + format(primitives));
+  stats.push_back("triangle mem: " + format(triangles));
+  stats.push_back("frames mem:   " + format(frames));
+  stats.push_back("sah cost:     " + format_stat(bvh_tree_cost(bvh)));
+  if (built > 0) {
+    stats.push_back("shapes sah:   " + format_stat(shapes_cost / built));
+  }
+  stats.push_back("leaves:       " + format(tree.leaves));
+  auto leaves = (double)max(tree.leaves, (uint64_t)1);
+  stats.push_back("leaf prims:   " + format_stat(tree.primitives / leaves));
+  stats.push_back("leaf fill %:  " +
+                  format_stat(100 * tree.primitives / (leaves * bvh_max_prims)));
+  for (auto depth = 0; depth < (int)tree.depths.size(); depth += 4) {
+    auto count = (uint64_t)0;
+    for (auto idx = depth; idx < min(depth + 4, (int)tree.depths.size());
+         idx++)
+      count += tree.depths[idx];
+    auto label = "depth " + std::to_string(depth) + "-" +
+                 std::to_string(depth + 3) + ":";
+    while (label.size() < 14) label += " ";
+    stats.push_back(label + format(count));
+  }
+  return stats;
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR BVH TRAVERSAL COUNTERS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+#ifdef YOCTO_BVH_STATS
+
+// Counters of all threads. Each thread takes a slot the first time it counts
+// and gives it back when it exits, so that totals include finished threads
+// and slots are reused by new ones.
+static std::mutex                             bvh_counters_mutex;
+static vector<unique_ptr<bvh_group_counters>> bvh_counters_slots;
+static vector<int>                            bvh_counters_free;
+
+// Counting state of a thread, with the stack depth of its current query.
+struct bvh_thread_state {
+  bvh_group_counters* counters = nullptr;
+  int                 slot     = -1;
+  int                 group    = 0;
+  int                 depth    = 0;
+
+  bvh_thread_state() {
+    auto lock = std::lock_guard{bvh_counters_mutex};
+    if (!bvh_counters_free.empty()) {
+      slot = bvh_counters_free.back();
+      bvh_counters_free.pop_back();
+    } else {
+      slot = (int)bvh_counters_slots.size();
+      bvh_counters_slots.push_back(std::make_unique<bvh_group_counters>());
+    }
+    counters = bvh_counters_slots[slot].get();
+  }
+  ~bvh_thread_state() {
+    auto lock = std::lock_guard{bvh_counters_mutex};
+    bvh_counters_free.push_back(slot);
+  }
+};
+static thread_local bvh_thread_state bvh_thread;
+
+// Count the rays of a query, from its start to its end.
+struct bvh_count_rays {
+  int rays = 0;
+  bvh_count_rays(int rays_) : rays{rays_} {
+    bvh_thread.depth = 0;
+    (*bvh_thread.counters)[bvh_thread.group].rays += rays;
+  }
+  ~bvh_count_rays() {
+    auto& counters = (*bvh_thread.counters)[bvh_thread.group];
+    counters.depth += (uint64_t)bvh_thread.depth * rays;
+    counters.max_depth = max(counters.max_depth, (uint64_t)bvh_thread.depth);
+  }
+};
+
+// Count a node visit, given the size of the node stack.
+static void count_node(int depth) {
+  (*bvh_thread.counters)[bvh_thread.group].nodes += 1;
+  bvh_thread.depth = max(bvh_thread.depth, depth);
+}
+
+// Count instance visits and primitive tests.
+static void count_instances(int num) {
+  (*bvh_thread.counters)[bvh_thread.group].instances += num;
+}
+static void count_primitives(int num) {
+  (*bvh_thread.counters)[bvh_thread.group].primitives += num;
+}
+
+int set_bvh_counter_group(int group) {
+  auto previous    = bvh_thread.group;
+  bvh_thread.group = clamp(group, 0, bvh_counter_groups - 1);
+  return previous;
+}
+
+const bvh_group_counters& get_bvh_thread_counters() {
+  return *bvh_thread.counters;
+}
+
+bvh_group_counters get_bvh_counters() {
+  auto lock   = std::lock_guard{bvh_counters_mutex};
+  auto totals = bvh_group_counters{};
+  for (auto& slot : bvh_counters_slots) {
+    for (auto group = 0; group < bvh_counter_groups; group++) {
+      auto &total = totals[group], &counters = (*slot)[group];
+      total.rays += counters.rays;
+      total.nodes += counters.nodes;
+      total.instances += counters.instances;
+      total.primitives += counters.primitives;
+      total.depth += counters.depth;
+      total.max_depth = max(total.max_depth, counters.max_depth);
+    }
+  }
+  return totals;
+}
+
+void reset_bvh_counters() {
+  auto lock = std::lock_guard{bvh_counters_mutex};
+  for (auto& slot : bvh_counters_slots) *slot = {};
+}
+
+#else
+
+// Counting is compiled out.
+struct bvh_count_rays {
+  bvh_count_rays(int rays) {}
+};
+static void count_node(int depth) {}
+static void count_instances(int num) {}
+static void count_primitives(int num) {}
+
+int set_bvh_counter_group(int group) { return 0; }
+
+const bvh_group_counters& get_bvh_thread_counters() {
+  static const auto counters = bvh_group_counters{};
+  return counters;
+}
+
+bvh_group_counters get_bvh_counters() { return {}; }
+void               reset_bvh_counters() {}
+
+#endif
+
+// Statistics of the counters
+vector<string> bvh_stats(const bvh_counters& counters) {
+  auto rays  = (double)max(counters.rays, (uint64_t)1);
+  auto stats = vector<string>{};
+  stats.push_back("rays:         " + format_stat(counters.rays));
+  stats.push_back("nodes:        " + format_stat(counters.nodes));
+  stats.push_back("instances:    " + format_stat(counters.instances));
+  stats.push_back("primitives:   " + format_stat(counters.primitives));
+  stats.push_back("nodes/ray:    " + format_stat(counters.nodes / rays));
+  stats.push_back("inst/ray:     " + format_stat(counters.instances / rays));
+  stats.push_back("prims/ray:    " + format_stat(counters.primitives / rays));
+  stats.push_back("depth/ray:    " + format_stat(counters.depth / rays));
+  stats.push_back("max depth:    " + format_stat(counters.max_depth));
+  return stats;
 }
 
 }  // namespace yocto
@@ -695,25 +2092,234 @@ void update_bvh(bvh_data& bvh, const scene_data& scene,
 // -----------------------------------------------------------------------------
 namespace yocto {
 
-// Intersect ray with a bvh.
-static bool intersect_bvh(const bvh_data& bvh, const shape_data& shape,
-    const ray3f& ray_, int& element, vec2f& uv, float& distance,
-    bool find_any) {
-#ifdef YOCTO_EMBREE
-  // call Embree if needed
-  if (bvh.embree_bvh) {
-    return intersect_embree_bvh(
-        bvh, shape, ray_, element, uv, distance, find_any);
+// Intersect a ray with a triangle stored in the bvh. This matches
+// intersect_triangle, with the edges already computed.
+static bool intersect_triangle(
+    const ray3f& ray, const bvh_triangle& triangle, vec2f& uv, float& dist) {
+  // compute determinant to solve a linear system
+  auto pvec = cross(ray.d, triangle.e2);
+  auto det  = dot(triangle.e1, pvec);
+
+  // check determinant and exit if triangle and ray are parallel
+  if (det == 0) return false;
+  auto inv_det = 1.0f / det;
+
+  // compute and check first bricentric coordinated
+  auto tvec = ray.o - triangle.p0;
+  auto u    = dot(tvec, pvec) * inv_det;
+  if (u < 0 || u > 1) return false;
+
+  // compute and check second bricentric coordinated
+  auto qvec = cross(tvec, triangle.e1);
+  auto v    = dot(ray.d, qvec) * inv_det;
+  if (v < 0 || u + v > 1) return false;
+
+  // compute and check ray parameter
+  auto t = dot(triangle.e2, qvec) * inv_det;
+  if (t < ray.tmin || t > ray.tmax) return false;
+
+  // intersection occurred: set params and exit
+  uv   = {u, v};
+  dist = t;
+  return true;
+}
+
+// Filter accepting all hits, used by queries without a filter.
+struct bvh_accept_hits {
+  bool operator()(int element, const vec2f& uv) const { return true; }
+  bool operator()(int instance, int element, const vec2f& uv) const {
+    return true;
+  }
+  bool operator()(int ray, int instance, int element, const vec2f& uv) const {
+    return true;
+  }
+};
+
+// Intersect a ray with the primitives of a shape leaf. Hits are passed to
+// `filter(element, uv)` and skipped if it rejects them. The ray is shortened
+// at each accepted hit.
+template <typename Filter = bvh_accept_hits>
+static bool intersect_leaf(const bvh_data& bvh, const shape_data& shape,
+    int start, int num, ray3f& ray, int& element, vec2f& uv, float& distance,
+    Filter&& filter = {}) {
+  count_primitives(num);
+  auto hit          = false;
+  auto hit_uv       = vec2f{0, 0};
+  auto hit_distance = 0.0f;
+  auto accept_hit   = [&](int idx) {
+    if (!filter(bvh.primitives[idx], hit_uv)) return;
+    hit      = true;
+    element  = bvh.primitives[idx];
+    uv       = hit_uv;
+    distance = hit_distance;
+    ray.tmax = hit_distance;
+  };
+  if (!bvh.triangles.empty() && !shape.triangles.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      if (intersect_triangle(ray, bvh.triangles[idx], hit_uv, hit_distance))
+        accept_hit(idx);
+    }
+  } else if (!bvh.triangles.empty() && !shape.quads.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      if (intersect_triangle(
+              ray, bvh.triangles[idx * 2 + 0], hit_uv, hit_distance))
+        accept_hit(idx);
+      if (intersect_triangle(
+              ray, bvh.triangles[idx * 2 + 1], hit_uv, hit_distance)) {
+        hit_uv = 1 - hit_uv;
+        accept_hit(idx);
+      }
+    }
+  } else if (!shape.points.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& p = shape.points[bvh.primitives[idx]];
+      if (intersect_point(
+              ray, shape.positions[p], shape.radius[p], hit_uv, hit_distance))
+        accept_hit(idx);
+    }
+  } else if (!shape.lines.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& l = shape.lines[bvh.primitives[idx]];
+      if (intersect_line(ray, shape.positions[l.x], shape.positions[l.y],
+              shape.radius[l.x], shape.radius[l.y], hit_uv, hit_distance))
+        accept_hit(idx);
+    }
+  } else if (!shape.triangles.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& t = shape.triangles[bvh.primitives[idx]];
+      if (intersect_triangle(ray, shape.positions[t.x], shape.positions[t.y],
+              shape.positions[t.z], hit_uv, hit_distance))
+        accept_hit(idx);
+    }
+  } else if (!shape.quads.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& q = shape.quads[bvh.primitives[idx]];
+      if (intersect_quad(ray, shape.positions[q.x], shape.positions[q.y],
+              shape.positions[q.z], shape.positions[q.w], hit_uv,
+              hit_distance))
+        accept_hit(idx);
+    }
+  }
+  return hit;
+}
+
+// Intersect a ray with the children of a wide node, testing all bounds at
+// once. Returns the mask of the children hit and sets their entry distance.
+static int intersect_node4(const bvh_node4& node, const ray3f& ray,
+    const vec3f& ray_dinv, array<float, 4>& distances) {
+#ifdef YOCTO_BVH_SSE
+  auto tmin = _mm_set1_ps(ray.tmin);
+  auto tmax = _mm_set1_ps(ray.tmax * 1.00000024f);
+  for (auto axis = 0; axis < 3; axis++) {
+    auto origin = _mm_set1_ps(ray.o[axis]);
+    auto dinv   = _mm_set1_ps(ray_dinv[axis]);
+    auto t0     = _mm_mul_ps(
+        _mm_sub_ps(_mm_load_ps(node.min[axis].data()), origin), dinv);
+    auto t1 = _mm_mul_ps(
+        _mm_sub_ps(_mm_load_ps(node.max[axis].data()), origin), dinv);
+    tmin = _mm_max_ps(tmin, _mm_min_ps(t0, t1));
+    tmax = _mm_min_ps(tmax, _mm_max_ps(t0, t1));
+  }
+  _mm_storeu_ps(distances.data(), tmin);
+  return _mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) & ((1 << node.count) - 1);
+#else
+  auto mask = 0;
+  for (auto idx = 0; idx < node.count; idx++) {
+    auto tmin = ray.tmin, tmax = ray.tmax * 1.00000024f;
+    for (auto axis = 0; axis < 3; axis++) {
+      auto t0 = (node.min[axis][idx] - ray.o[axis]) * ray_dinv[axis];
+      auto t1 = (node.max[axis][idx] - ray.o[axis]) * ray_dinv[axis];
+      tmin    = max(tmin, min(t0, t1));
+      tmax    = min(tmax, max(t0, t1));
+    }
+    distances[idx] = tmin;
+    if (tmin <= tmax) mask |= 1 << idx;
   }
+  return mask;
 #endif
+}
 
-  // check empty
-  if (bvh.nodes.empty()) return false;
+// Traverse the wide nodes of a bvh, visiting children near to far and
+// skipping the ones farther than the current hit. Leaves are intersected by
+// calling `intersect_leaf(start, num, ray)`, that returns whether it found a
+// hit and, if so, shortens the ray.
+template <typename Intersect>
+static bool intersect_wide_bvh(const bvh_data& bvh, const ray3f& ray_,
+    bool find_any, Intersect&& intersect_leaf) {
+  // node stack, with leaves encoded as negative references to their slot,
+  // and the entry distance of each node; stacks are not cleared, since
+  // shape traversals are short and run once per instance
+  array<int, 128>   node_stack;
+  array<float, 128> node_distances;
+  auto              node_cur = 0;
+  node_stack[node_cur]       = 0;
+  node_distances[node_cur++] = ray_.tmin;
 
+  // shared variables
+  auto hit = false;
+
+  // copy ray to modify it
+  auto ray = ray_;
+
+  // prepare ray for fast queries
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+
+  // walking stack
+  while (node_cur != 0) {
+    // grab entry, skipping it if it is behind the current hit
+    auto entry = node_stack[--node_cur];
+    if (node_distances[node_cur] > ray.tmax * 1.00000024f) continue;
+    count_node(node_cur + 1);
+
+    // intersect leaf
+    if (entry < 0) {
+      auto& node  = bvh.wide_nodes[(~entry) >> 2];
+      auto  child = (~entry) & 3;
+      if (intersect_leaf(node.start[child], node.num[child], ray)) {
+        hit = true;
+        if (find_any) return hit;
+      }
+      continue;
+    }
+
+    // intersect children bounds
+    auto& node      = bvh.wide_nodes[entry];
+    auto  distances = array<float, 4>{};
+    auto  mask      = intersect_node4(node, ray, ray_dinv, distances);
+    if (mask == 0) continue;
+
+    // sort children from far to near, so that the nearest is popped first
+    auto children = array<int, 4>{};
+    auto count    = 0;
+    for (auto idx = 0; idx < 4; idx++) {
+      if ((mask & (1 << idx)) == 0) continue;
+      auto pos = count++;
+      while (pos > 0 && distances[children[pos - 1]] < distances[idx]) {
+        children[pos] = children[pos - 1];
+        pos--;
+      }
+      children[pos] = idx;
+    }
+    for (auto idx = 0; idx < count; idx++) {
+      auto child           = children[idx];
+      node_stack[node_cur] = node.internal[child] ? node.start[child]
+                                                  : ~(entry * 4 + child);
+      node_distances[node_cur++] = distances[child];
+    }
+  }
+
+  return hit;
+}
+
+// Intersect ray with the subtree of a bvh rooted at a node.
+template <typename Filter = bvh_accept_hits>
+static bool intersect_subtree(const bvh_data& bvh, const shape_data& shape,
+    int root, const ray3f& ray_, int& element, vec2f& uv, float& distance,
+    bool find_any, Filter&& filter = {}) {
   // node stack
   auto node_stack        = array<int, 128>{};
   auto node_cur          = 0;
-  node_stack[node_cur++] = 0;
+  node_stack[node_cur++] = root;
 
   // shared variables
   auto hit = false;
@@ -730,6 +2336,7 @@ static bool intersect_bvh(const bvh_data& bvh, const shape_data& shape,
   while (node_cur != 0) {
     // grab node
     auto& node = bvh.nodes[node_stack[--node_cur]];
+    count_node(node_cur + 1);
 
     // intersect bbox
     // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
@@ -747,46 +2354,10 @@ static bool intersect_bvh(const bvh_data& bvh, const shape_data& shape,
         node_stack[node_cur++] = node.start + 1;
         node_stack[node_cur++] = node.start + 0;
       }
-    } else if (!shape.points.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& p = shape.points[bvh.primitives[idx]];
-        if (intersect_point(
-                ray, shape.positions[p], shape.radius[p], uv, distance)) {
-          hit      = true;
-          element  = bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
-    } else if (!shape.lines.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& l = shape.lines[bvh.primitives[idx]];
-        if (intersect_line(ray, shape.positions[l.x], shape.positions[l.y],
-                shape.radius[l.x], shape.radius[l.y], uv, distance)) {
-          hit      = true;
-          element  = bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
-    } else if (!shape.triangles.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& t = shape.triangles[bvh.primitives[idx]];
-        if (intersect_triangle(ray, shape.positions[t.x], shape.positions[t.y],
-                shape.positions[t.z], uv, distance)) {
-          hit      = true;
-          element  = bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
-    } else if (!shape.quads.empty()) {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& q = shape.quads[bvh.primitives[idx]];
-        if (intersect_quad(ray, shape.positions[q.x], shape.positions[q.y],
-                shape.positions[q.z], shape.positions[q.w], uv, distance)) {
-          hit      = true;
-          element  = bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
+    } else {
+      if (intersect_leaf(bvh, shape, node.start, node.num, ray, element, uv,
+              distance, filter))
+        hit = true;
     }
 
     // check for early exit
@@ -796,21 +2367,109 @@ static bool intersect_bvh(const bvh_data& bvh, const shape_data& shape,
   return hit;
 }
 
-// Intersect ray with a bvh.
+// Intersect ray with a bvh. Hits rejected by `filter(element, uv)` are
+// skipped.
+template <typename Filter = bvh_accept_hits>
+static bool intersect_bvh(const bvh_data& bvh, const shape_data& shape,
+    const ray3f& ray_, int& element, vec2f& uv, float& distance,
+    bool find_any, Filter&& filter = {}) {
+#ifdef YOCTO_EMBREE
+  // call Embree if needed, skipping rejected hits by restarting past them
+  if (bvh.embree_bvh) {
+    auto ray = ray_;
+    while (intersect_embree_bvh(
+        bvh, shape, ray, element, uv, distance, find_any)) {
+      if (filter(element, uv)) return true;
+      ray.tmin = std::nextafter(distance, flt_max);
+    }
+    return false;
+  }
+#endif
+
+  // check empty
+  if (bvh.nodes.empty()) return false;
+
+  // use wide nodes if present
+  if (!bvh.wide_nodes.empty()) {
+    return intersect_wide_bvh(
+        bvh, ray_, find_any, [&](int start, int num, ray3f& ray) {
+          return intersect_leaf(
+              bvh, shape, start, num, ray, element, uv, distance, filter);
+        });
+  }
+
+  return intersect_subtree(
+      bvh, shape, 0, ray_, element, uv, distance, find_any, filter);
+}
+
+// Inverse frame of an instance, taken from the bvh when it is stored there.
+static frame3f get_inverse_frame(const bvh_data& bvh, const scene_data& scene,
+    int instance, bool non_rigid_frames) {
+  if (instance < (int)bvh.inverse_frames.size())
+    return bvh.inverse_frames[instance];
+  return inverse(scene.instances[instance].frame, non_rigid_frames);
+}
+
+// Intersect a ray with the instances of a scene leaf. Hits rejected by
+// `filter(instance, element, uv)` are skipped. The ray is shortened at each
+// accepted hit.
+template <typename Filter = bvh_accept_hits>
+static bool intersect_leaf(const bvh_data& bvh, const scene_data& scene,
+    int start, int num, ray3f& ray, int& instance, int& element, vec2f& uv,
+    float& distance, bool find_any, bool non_rigid_frames,
+    Filter&& filter = {}) {
+  count_instances(num);
+  auto hit = false;
+  for (auto idx = start; idx < start + num; idx++) {
+    auto& instance_ = scene.instances[bvh.primitives[idx]];
+    auto  inv_ray   = transform_ray(
+        get_inverse_frame(bvh, scene, bvh.primitives[idx], non_rigid_frames),
+        ray);
+    auto shape_filter = [&](int element, const vec2f& uv) {
+      return filter(bvh.primitives[idx], element, uv);
+    };
+    if (intersect_bvh(get_shape_bvh(bvh, instance_.shape),
+            scene.shapes[instance_.shape], inv_ray, element, uv, distance,
+            find_any, shape_filter)) {
+      hit      = true;
+      instance = bvh.primitives[idx];
+      ray.tmax = distance;
+    }
+  }
+  return hit;
+}
+
+// Intersect ray with a bvh. Hits rejected by `filter(instance, element, uv)`
+// are skipped.
+template <typename Filter = bvh_accept_hits>
 static bool intersect_bvh(const bvh_data& bvh, const scene_data& scene,
     const ray3f& ray_, int& instance, int& element, vec2f& uv, float& distance,
-    bool find_any, bool non_rigid_frames) {
+    bool find_any, bool non_rigid_frames, Filter&& filter = {}) {
 #ifdef YOCTO_EMBREE
-  // call Embree if needed
+  // call Embree if needed, skipping rejected hits by restarting past them
   if (bvh.embree_bvh) {
-    return intersect_embree_bvh(
-        bvh, scene, ray_, instance, element, uv, distance, find_any);
+    auto ray = ray_;
+    while (intersect_embree_bvh(
+        bvh, scene, ray, instance, element, uv, distance, find_any)) {
+      if (filter(instance, element, uv)) return true;
+      ray.tmin = std::nextafter(distance, flt_max);
+    }
+    return false;
   }
 #endif
 
   // check empty
   if (bvh.nodes.empty()) return false;
 
+  // use wide nodes if present
+  if (!bvh.wide_nodes.empty()) {
+    return intersect_wide_bvh(
+        bvh, ray_, find_any, [&](int start, int num, ray3f& ray) {
+          return intersect_leaf(bvh, scene, start, num, ray, instance, element,
+              uv, distance, find_any, non_rigid_frames, filter);
+        });
+  }
+
   // node stack
   auto node_stack        = array<int, 128>{};
   auto node_cur          = 0;
@@ -831,6 +2490,7 @@ static bool intersect_bvh(const bvh_data& bvh, const scene_data& scene,
   while (node_cur != 0) {
     // grab node
     auto& node = bvh.nodes[node_stack[--node_cur]];
+    count_node(node_cur + 1);
 
     // intersect bbox
     // if (!intersect_bbox(ray, ray_dinv, ray_dsign, node.bbox)) continue;
@@ -849,18 +2509,9 @@ static bool intersect_bvh(const bvh_data& bvh, const scene_data& scene,
         node_stack[node_cur++] = node.start + 0;
       }
     } else {
-      for (auto idx = node.start; idx < node.start + node.num; idx++) {
-        auto& instance_ = scene.instances[bvh.primitives[idx]];
-        auto  inv_ray   = transform_ray(
-            inverse(instance_.frame, non_rigid_frames), ray);
-        if (intersect_bvh(bvh.shapes[instance_.shape],
-                scene.shapes[instance_.shape], inv_ray, element, uv, distance,
-                find_any)) {
-          hit      = true;
-          instance = bvh.primitives[idx];
-          ray.tmax = distance;
-        }
-      }
+      if (intersect_leaf(bvh, scene, node.start, node.num, ray, instance,
+              element, uv, distance, find_any, non_rigid_frames, filter))
+        hit = true;
     }
 
     // check for early exit
@@ -875,9 +2526,495 @@ static bool intersect_bvh(const bvh_data& bvh, const scene_data& scene,
     int instance_, const ray3f& ray, int& element, vec2f& uv, float& distance,
     bool find_any, bool non_rigid_frames) {
   auto& instance = scene.instances[instance_];
-  auto  inv_ray = transform_ray(inverse(instance.frame, non_rigid_frames), ray);
-  return intersect_bvh(bvh.shapes[instance.shape], scene.shapes[instance.shape],
-      inv_ray, element, uv, distance, find_any);
+  auto  inv_ray  = transform_ray(
+      get_inverse_frame(bvh, scene, instance_, non_rigid_frames), ray);
+  return intersect_bvh(get_shape_bvh(bvh, instance.shape),
+      scene.shapes[instance.shape], inv_ray, element, uv, distance, find_any);
+}
+
+// Sort the rays of a stream by direction octant, then by origin within the
+// stream bounds. Returns the indices of the rays in sorted order.
+static vector<int> sort_rays(const vector<ray3f>& rays) {
+  auto bbox = invalidb3f;
+  for (auto& ray : rays) bbox = merge(bbox, ray.o);
+  auto keys = vector<uint32_t>(rays.size());
+  for (auto idx = 0; idx < (int)rays.size(); idx++) {
+    auto& ray    = rays[idx];
+    auto  octant = (ray.d.x < 0 ? 1u : 0u) | (ray.d.y < 0 ? 2u : 0u) |
+                  (ray.d.z < 0 ? 4u : 0u);
+    keys[idx] = (octant << 27) | (morton_code(ray.o, bbox) >> 3);
+  }
+  return sort_keys(keys);
+}
+
+// Rays of a packet. Origins, inverse directions and ranges are also stored
+// by component, so that node bounds are tested for four rays at once. Ray
+// ranges are shortened at each hit.
+template <size_t N>
+struct alignas(16) bvh_packet {
+  array<array<float, N>, 3> origin = {};
+  array<array<float, N>, 3> dinv   = {};
+  array<float, N>           tmin   = {};
+  array<float, N>           tmax   = {};
+  array<ray3f, N>           rays   = {};
+};
+
+// Set a ray of a packet.
+template <size_t N>
+static void set_ray(bvh_packet<N>& packet, int idx, const ray3f& ray) {
+  packet.rays[idx] = ray;
+  for (auto axis = 0; axis < 3; axis++) {
+    packet.origin[axis][idx] = ray.o[axis];
+    packet.dinv[axis][idx]   = 1 / ray.d[axis];
+  }
+  packet.tmin[idx] = ray.tmin;
+  packet.tmax[idx] = ray.tmax;
+}
+
+// Shorten a ray of a packet after a hit.
+template <size_t N>
+static void set_tmax(bvh_packet<N>& packet, int idx, float tmax) {
+  packet.rays[idx].tmax = tmax;
+  packet.tmax[idx]      = tmax;
+}
+
+// Number of rays in a packet mask.
+static int count_rays(uint32_t mask) {
+  auto count = 0;
+  for (; mask != 0; mask &= mask - 1) count++;
+  return count;
+}
+
+// Intersect the rays of a packet in `mask` with a bounding box. Returns the
+// mask of the rays that hit it.
+template <size_t N>
+static uint32_t intersect_bbox(
+    const bvh_packet<N>& packet, const bbox3f& bbox, uint32_t mask) {
+  auto hits = 0u;
+#ifdef YOCTO_BVH_SSE
+  for (auto group = 0; group < (int)N; group += 4) {
+    if (((mask >> group) & 15) == 0) continue;
+    auto tmin = _mm_load_ps(packet.tmin.data() + group);
+    auto tmax = _mm_load_ps(packet.tmax.data() + group);
+    for (auto axis = 0; axis < 3; axis++) {
+      auto origin = _mm_load_ps(packet.origin[axis].data() + group);
+      auto dinv   = _mm_load_ps(packet.dinv[axis].data() + group);
+      auto t0     = _mm_mul_ps(
+          _mm_sub_ps(_mm_set1_ps(bbox.min[axis]), origin), dinv);
+      auto t1 = _mm_mul_ps(
+          _mm_sub_ps(_mm_set1_ps(bbox.max[axis]), origin), dinv);
+      tmin = _mm_max_ps(tmin, _mm_min_ps(t0, t1));
+      tmax = _mm_min_ps(tmax, _mm_max_ps(t0, t1));
+    }
+    tmax = _mm_mul_ps(tmax, _mm_set1_ps(1.00000024f));
+    hits |= (uint32_t)_mm_movemask_ps(_mm_cmple_ps(tmin, tmax)) << group;
+  }
+  return hits & mask;
+#else
+  for (auto idx = 0; idx < (int)N; idx++) {
+    if ((mask & (1u << idx)) == 0) continue;
+    auto tmin = packet.tmin[idx], tmax = packet.tmax[idx];
+    for (auto axis = 0; axis < 3; axis++) {
+      auto t0 = (bbox.min[axis] - packet.origin[axis][idx]) *
+                packet.dinv[axis][idx];
+      auto t1 = (bbox.max[axis] - packet.origin[axis][idx]) *
+                packet.dinv[axis][idx];
+      tmin = max(tmin, min(t0, t1));
+      tmax = min(tmax, max(t0, t1));
+    }
+    if (tmin <= tmax * 1.00000024f) hits |= 1u << idx;
+  }
+  return hits;
+#endif
+}
+
+// Intersect the rays of a packet in `mask` with a shape bvh. Returns the
+// mask of the rays that hit. When a quarter of the packet or less reaches a
+// node, the packet has diverged and the subtree of the node is traced one
+// ray at a time. Hits rejected by `filter(ray, element, uv)`, with the index
+// of the ray in the packet, are skipped.
+template <size_t N, typename Filter = bvh_accept_hits>
+static uint32_t intersect_bvh(const bvh_data& bvh, const shape_data& shape,
+    bvh_packet<N>& packet, uint32_t mask, array<int, N>& elements,
+    array<vec2f, N>& uvs, array<float, N>& distances, Filter&& filter = {}) {
+  // filter of the hits of a ray of the packet
+  auto ray_filter = [&filter](int ray) {
+    return [&filter, ray](int element, const vec2f& uv) {
+      return filter(ray, element, uv);
+    };
+  };
+
+  // trace rays one at a time from a node
+  auto intersect_rays = [&](int root, uint32_t rays) {
+    auto hits = 0u;
+    for (auto idx = 0; idx < (int)N; idx++) {
+      if ((rays & (1u << idx)) == 0) continue;
+      if (intersect_subtree(bvh, shape, root, packet.rays[idx], elements[idx],
+              uvs[idx], distances[idx], false, ray_filter(idx))) {
+        hits |= 1u << idx;
+        set_tmax(packet, idx, distances[idx]);
+      }
+    }
+    return hits;
+  };
+
+#ifdef YOCTO_EMBREE
+  // call Embree if needed
+  if (bvh.embree_bvh) {
+    auto hits = 0u;
+    for (auto idx = 0; idx < (int)N; idx++) {
+      if ((mask & (1u << idx)) == 0) continue;
+      if (intersect_bvh(bvh, shape, packet.rays[idx], elements[idx], uvs[idx],
+              distances[idx], false, ray_filter(idx))) {
+        hits |= 1u << idx;
+        set_tmax(packet, idx, distances[idx]);
+      }
+    }
+    return hits;
+  }
+#endif
+
+  // check empty
+  if (bvh.nodes.empty() || mask == 0) return 0;
+
+  // node stack, with the mask of the rays that reached the parent
+  array<int, 128>      node_stack;
+  array<uint32_t, 128> mask_stack;
+  auto                 node_cur = 0;
+  node_stack[node_cur]          = 0;
+  mask_stack[node_cur++]        = mask;
+
+  // shared variables
+  auto hits = 0u;
+
+  // traversal order, taken from the first ray, since rays share an octant
+  auto first = 0;
+  while ((mask & (1u << first)) == 0) first++;
+  auto ray_dsign = vec3i{packet.dinv[0][first] < 0 ? 1 : 0,
+      packet.dinv[1][first] < 0 ? 1 : 0, packet.dinv[2][first] < 0 ? 1 : 0};
+
+  // walking stack
+  while (node_cur != 0) {
+    // grab node
+    auto  node_id   = node_stack[--node_cur];
+    auto& node      = bvh.nodes[node_id];
+    auto  node_mask = intersect_bbox(packet, node.bbox, mask_stack[node_cur]);
+    count_node(node_cur + 1);
+    if (node_mask == 0) continue;
+
+    // check for divergence
+    if (count_rays(node_mask) <= (int)N / 4) {
+      hits |= intersect_rays(node_id, node_mask);
+      continue;
+    }
+
+    // intersect node, switching based on node type
+    if (node.internal) {
+      // for internal nodes, attempts to proceed along the
+      // split axis from smallest to largest nodes
+      if (ray_dsign[node.axis] != 0) {
+        node_stack[node_cur]   = node.start + 0;
+        mask_stack[node_cur++] = node_mask;
+        node_stack[node_cur]   = node.start + 1;
+        mask_stack[node_cur++] = node_mask;
+      } else {
+        node_stack[node_cur]   = node.start + 1;
+        mask_stack[node_cur++] = node_mask;
+        node_stack[node_cur]   = node.start + 0;
+        mask_stack[node_cur++] = node_mask;
+      }
+    } else {
+      for (auto idx = 0; idx < (int)N; idx++) {
+        if ((node_mask & (1u << idx)) == 0) continue;
+        if (intersect_leaf(bvh, shape, node.start, node.num, packet.rays[idx],
+                elements[idx], uvs[idx], distances[idx], ray_filter(idx))) {
+          hits |= 1u << idx;
+          set_tmax(packet, idx, distances[idx]);
+        }
+      }
+    }
+  }
+
+  return hits;
+}
+
+// Intersect the rays of a packet in `mask` with a scene bvh. Returns the
+// mask of the rays that hit. The rays reaching an instance are moved to its
+// local frame and traced there as a new packet. Hits rejected by
+// `filter(ray, instance, element, uv)` are skipped.
+template <size_t N, typename Filter = bvh_accept_hits>
+static uint32_t intersect_bvh(const bvh_data& bvh, const scene_data& scene,
+    bvh_packet<N>& packet, uint32_t mask, array<int, N>& instances,
+    array<int, N>& elements, array<vec2f, N>& uvs,
+    array<float, N>& distances, bool non_rigid_frames, Filter&& filter = {}) {
+  // check empty
+  if (bvh.nodes.empty() || mask == 0) return 0;
+
+  // node stack, with the mask of the rays that reached the parent
+  array<int, 128>      node_stack;
+  array<uint32_t, 128> mask_stack;
+  auto                 node_cur = 0;
+  node_stack[node_cur]          = 0;
+  mask_stack[node_cur++]        = mask;
+
+  // shared variables
+  auto hits = 0u;
+
+  // traversal order, taken from the first ray, since rays share an octant
+  auto first = 0;
+  while ((mask & (1u << first)) == 0) first++;
+  auto ray_dsign = vec3i{packet.dinv[0][first] < 0 ? 1 : 0,
+      packet.dinv[1][first] < 0 ? 1 : 0, packet.dinv[2][first] < 0 ? 1 : 0};
+
+  // walking stack
+  while (node_cur != 0) {
+    // grab node
+    auto& node      = bvh.nodes[node_stack[--node_cur]];
+    auto  node_mask = intersect_bbox(packet, node.bbox, mask_stack[node_cur]);
+    count_node(node_cur + 1);
+    if (node_mask == 0) continue;
+
+    // intersect node, switching based on node type
+    if (node.internal) {
+      // for internal nodes, attempts to proceed along the
+      // split axis from smallest to largest nodes
+      if (ray_dsign[node.axis] != 0) {
+        node_stack[node_cur]   = node.start + 0;
+        mask_stack[node_cur++] = node_mask;
+        node_stack[node_cur]   = node.start + 1;
+        mask_stack[node_cur++] = node_mask;
+      } else {
+        node_stack[node_cur]   = node.start + 1;
+        mask_stack[node_cur++] = node_mask;
+        node_stack[node_cur]   = node.start + 0;
+        mask_stack[node_cur++] = node_mask;
+      }
+    } else {
+      count_instances(node.num);
+      for (auto prim = node.start; prim < node.start + node.num; prim++) {
+        auto  instance_id = bvh.primitives[prim];
+        auto& instance    = scene.instances[instance_id];
+        auto  inv_frame   = get_inverse_frame(
+            bvh, scene, instance_id, non_rigid_frames);
+        auto local = bvh_packet<N>{};
+        for (auto idx = 0; idx < (int)N; idx++) {
+          if ((node_mask & (1u << idx)) == 0) continue;
+          set_ray(local, idx, transform_ray(inv_frame, packet.rays[idx]));
+        }
+        auto shape_filter = [&](int ray, int element, const vec2f& uv) {
+          return filter(ray, instance_id, element, uv);
+        };
+        auto local_hits = intersect_bvh(get_shape_bvh(bvh, instance.shape),
+            scene.shapes[instance.shape], local, node_mask, elements, uvs,
+            distances, shape_filter);
+        for (auto idx = 0; idx < (int)N; idx++) {
+          if ((local_hits & (1u << idx)) == 0) continue;
+          instances[idx] = instance_id;
+          set_tmax(packet, idx, distances[idx]);
+        }
+        hits |= local_hits;
+      }
+    }
+  }
+
+  return hits;
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR BVH OCCLUSION
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Check whether a ray hits a triangle stored in the bvh. This is the test of
+// intersect_triangle with the barycentric coordinates and distance scaled by
+// the determinant, so that no division is needed.
+static bool occluded_triangle(const ray3f& ray, const bvh_triangle& triangle) {
+  auto pvec = cross(ray.d, triangle.e2);
+  auto det  = dot(triangle.e1, pvec);
+  if (det == 0) return false;
+  auto tvec = ray.o - triangle.p0;
+  auto qvec = cross(tvec, triangle.e1);
+  auto u    = dot(tvec, pvec);
+  auto v    = dot(ray.d, qvec);
+  auto t    = dot(triangle.e2, qvec);
+  if (det < 0) {
+    u   = -u;
+    v   = -v;
+    t   = -t;
+    det = -det;
+  }
+  return u >= 0 && v >= 0 && u + v <= det && t >= ray.tmin * det &&
+         t <= ray.tmax * det;
+}
+static bool occluded_triangle(
+    const ray3f& ray, const vec3f& p0, const vec3f& p1, const vec3f& p2) {
+  return occluded_triangle(ray, bvh_triangle{p0, p1 - p0, p2 - p0});
+}
+
+// Check whether a ray hits any primitive of a shape leaf.
+static bool occluded_leaf(const bvh_data& bvh, const shape_data& shape,
+    int start, int num, const ray3f& ray) {
+  count_primitives(num);
+  auto uv = vec2f{0, 0};
+  auto distance = 0.0f;
+  if (!bvh.triangles.empty() && !shape.triangles.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      if (occluded_triangle(ray, bvh.triangles[idx])) return true;
+    }
+  } else if (!bvh.triangles.empty() && !shape.quads.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      if (occluded_triangle(ray, bvh.triangles[idx * 2 + 0])) return true;
+      if (occluded_triangle(ray, bvh.triangles[idx * 2 + 1])) return true;
+    }
+  } else if (!shape.points.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& p = shape.points[bvh.primitives[idx]];
+      if (intersect_point(
+              ray, shape.positions[p], shape.radius[p], uv, distance))
+        return true;
+    }
+  } else if (!shape.lines.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& l = shape.lines[bvh.primitives[idx]];
+      if (intersect_line(ray, shape.positions[l.x], shape.positions[l.y],
+              shape.radius[l.x], shape.radius[l.y], uv, distance))
+        return true;
+    }
+  } else if (!shape.triangles.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& t = shape.triangles[bvh.primitives[idx]];
+      if (occluded_triangle(ray, shape.positions[t.x], shape.positions[t.y],
+              shape.positions[t.z]))
+        return true;
+    }
+  } else if (!shape.quads.empty()) {
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& q = shape.quads[bvh.primitives[idx]];
+      if (occluded_triangle(ray, shape.positions[q.x], shape.positions[q.y],
+              shape.positions[q.w]))
+        return true;
+      if (q.z != q.w &&
+          occluded_triangle(ray, shape.positions[q.z], shape.positions[q.w],
+              shape.positions[q.y]))
+        return true;
+    }
+  }
+  return false;
+}
+
+// Traverse a bvh until a leaf reports a hit, calling `occluded_leaf(start,
+// num)` on leaves. Children are visited in any order, since any hit will do.
+template <typename Occluded>
+static bool occluded_nodes(
+    const bvh_data& bvh, const ray3f& ray, Occluded&& occluded_leaf) {
+  // check empty
+  if (bvh.nodes.empty()) return false;
+
+  // node stack
+  array<int, 128> node_stack;
+  auto            node_cur = 0;
+  node_stack[node_cur++]   = 0;
+
+  // prepare ray for fast queries
+  auto ray_dinv = vec3f{1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z};
+
+  // walk wide nodes, with leaves encoded as negative references to their slot
+  if (!bvh.wide_nodes.empty()) {
+    while (node_cur != 0) {
+      auto entry = node_stack[--node_cur];
+      count_node(node_cur + 1);
+      if (entry < 0) {
+        auto& node  = bvh.wide_nodes[(~entry) >> 2];
+        auto  child = (~entry) & 3;
+        if (occluded_leaf(node.start[child], node.num[child])) return true;
+        continue;
+      }
+      auto& node      = bvh.wide_nodes[entry];
+      auto  distances = array<float, 4>{};
+      auto  mask      = intersect_node4(node, ray, ray_dinv, distances);
+      for (auto child = 0; child < 4; child++) {
+        if ((mask & (1 << child)) == 0) continue;
+        node_stack[node_cur++] = node.internal[child] ? node.start[child]
+                                                      : ~(entry * 4 + child);
+      }
+    }
+    return false;
+  }
+
+  // walk binary nodes
+  while (node_cur != 0) {
+    auto& node = bvh.nodes[node_stack[--node_cur]];
+    count_node(node_cur + 1);
+    if (!intersect_bbox(ray, ray_dinv, node.bbox)) continue;
+    if (node.internal) {
+      node_stack[node_cur++] = node.start + 0;
+      node_stack[node_cur++] = node.start + 1;
+    } else {
+      if (occluded_leaf(node.start, node.num)) return true;
+    }
+  }
+  return false;
+}
+
+bool occluded_bvh(
+    const bvh_data& bvh, const shape_data& shape, const ray3f& ray) {
+#ifdef YOCTO_EMBREE
+  // call Embree if needed
+  if (bvh.embree_bvh) {
+    auto element  = 0;
+    auto uv       = vec2f{0, 0};
+    auto distance = 0.0f;
+    return intersect_embree_bvh(
+        bvh, shape, ray, element, uv, distance, true);
+  }
+#endif
+
+  [[maybe_unused]] auto counter = bvh_count_rays{1};
+  return occluded_nodes(bvh, ray, [&](int start, int num) {
+    return occluded_leaf(bvh, shape, start, num, ray);
+  });
+}
+
+bool occluded_bvh(const bvh_data& bvh, const scene_data& scene,
+    const ray3f& ray, bool non_rigid_frames) {
+#ifdef YOCTO_EMBREE
+  // call Embree if needed
+  if (bvh.embree_bvh) {
+    auto instance = 0, element = 0;
+    auto uv       = vec2f{0, 0};
+    auto distance = 0.0f;
+    return intersect_embree_bvh(
+        bvh, scene, ray, instance, element, uv, distance, true);
+  }
+#endif
+
+  [[maybe_unused]] auto counter = bvh_count_rays{1};
+  return occluded_nodes(bvh, ray, [&](int start, int num) {
+    count_instances(num);
+    for (auto idx = start; idx < start + num; idx++) {
+      auto& instance = scene.instances[bvh.primitives[idx]];
+      auto& sbvh     = get_shape_bvh(bvh, instance.shape);
+      auto& shape    = scene.shapes[instance.shape];
+      auto  inv_ray  = transform_ray(
+          get_inverse_frame(bvh, scene, bvh.primitives[idx], non_rigid_frames),
+          ray);
+      if (occluded_nodes(sbvh, inv_ray, [&](int start, int num) {
+            return occluded_leaf(sbvh, shape, start, num, inv_ray);
+          }))
+        return true;
+    }
+    return false;
+  });
+}
+
+void occluded_bvh(const bvh_data& bvh, const scene_data& scene,
+    const vector<ray3f>& rays, vector<bool>& occluded, bool non_rigid_frames) {
+  occluded.assign(rays.size(), false);
+  for (auto idx = 0; idx < (int)rays.size(); idx++) {
+    occluded[idx] = occluded_bvh(bvh, scene, rays[idx], non_rigid_frames);
+  }
 }
 
 }  // namespace yocto
@@ -906,6 +3043,7 @@ static bool overlap_bvh(const bvh_data& bvh, const shape_data& shape,
   while (node_cur != 0) {
     // grab node
     auto& node = bvh.nodes[node_stack[--node_cur]];
+    count_node(node_cur + 1);
 
     // intersect bbox
     if (!overlap_bbox(pos, max_distance, node.bbox)) continue;
@@ -917,6 +3055,7 @@ static bool overlap_bvh(const bvh_data& bvh, const shape_data& shape,
       node_stack[node_cur++] = node.start + 0;
       node_stack[node_cur++] = node.start + 1;
     } else if (!shape.points.empty()) {
+      count_primitives(node.num);
       for (auto idx = 0; idx < node.num; idx++) {
         auto  primitive = bvh.primitives[node.start + idx];
         auto& p         = shape.points[primitive];
@@ -928,6 +3067,7 @@ static bool overlap_bvh(const bvh_data& bvh, const shape_data& shape,
         }
       }
     } else if (!shape.lines.empty()) {
+      count_primitives(node.num);
       for (auto idx = 0; idx < node.num; idx++) {
         auto  primitive = bvh.primitives[node.start + idx];
         auto& l         = shape.lines[primitive];
@@ -940,6 +3080,7 @@ static bool overlap_bvh(const bvh_data& bvh, const shape_data& shape,
         }
       }
     } else if (!shape.triangles.empty()) {
+      count_primitives(node.num);
       for (auto idx = 0; idx < node.num; idx++) {
         auto  primitive = bvh.primitives[node.start + idx];
         auto& t         = shape.triangles[primitive];
@@ -952,6 +3093,7 @@ static bool overlap_bvh(const bvh_data& bvh, const shape_data& shape,
         }
       }
     } else if (!shape.quads.empty()) {
+      count_primitives(node.num);
       for (auto idx = 0; idx < node.num; idx++) {
         auto  primitive = bvh.primitives[node.start + idx];
         auto& q         = shape.quads[primitive];
@@ -992,6 +3134,7 @@ static bool overlap_bvh(const bvh_data& bvh, const scene_data& scene,
   while (node_cur != 0) {
     // grab node
     auto& node = bvh.nodes[node_stack[--node_cur]];
+    count_node(node_cur + 1);
 
     // intersect bbox
     if (!overlap_bbox(pos, max_distance, node.bbox)) continue;
@@ -1003,13 +3146,14 @@ static bool overlap_bvh(const bvh_data& bvh, const scene_data& scene,
       node_stack[node_cur++] = node.start + 0;
       node_stack[node_cur++] = node.start + 1;
     } else {
+      count_instances(node.num);
       for (auto idx = 0; idx < node.num; idx++) {
         auto  primitive = bvh.primitives[node.start + idx];
         auto& instance_ = scene.instances[primitive];
         auto& shape     = scene.shapes[instance_.shape];
-        auto& sbvh      = bvh.shapes[instance_.shape];
+        auto& sbvh      = get_shape_bvh(bvh, instance_.shape);
         auto  inv_pos   = transform_point(
-            inverse(instance_.frame, non_rigid_frames), pos);
+            get_inverse_frame(bvh, scene, primitive, non_rigid_frames), pos);
         if (overlap_bvh(sbvh, shape, inv_pos, max_distance, element, uv,
                 distance, find_any)) {
           hit          = true;
@@ -1089,6 +3233,8 @@ void overlap_bvh_elems(const bvh_data& bvh1, const bvh_data& bvh2,
 
 bvh_intersection intersect_bvh(const bvh_data& bvh, const shape_data& shape,
     const ray3f& ray, bool find_any) {
+  [[maybe_unused]] auto counter = bvh_count_rays{1};
+
   auto intersection = bvh_intersection{};
   intersection.hit  = intersect_bvh(bvh, shape, ray, intersection.element,
       intersection.uv, intersection.distance, find_any);
@@ -1096,14 +3242,29 @@ bvh_intersection intersect_bvh(const bvh_data& bvh, const shape_data& shape,
 }
 bvh_intersection intersect_bvh(const bvh_data& bvh, const scene_data& scene,
     const ray3f& ray, bool find_any, bool non_rigid_frames) {
+  [[maybe_unused]] auto counter = bvh_count_rays{1};
+
   auto intersection = bvh_intersection{};
   intersection.hit  = intersect_bvh(bvh, scene, ray, intersection.instance,
       intersection.element, intersection.uv, intersection.distance, find_any,
       non_rigid_frames);
   return intersection;
 }
+bvh_intersection intersect_bvh(const bvh_data& bvh, const scene_data& scene,
+    const ray3f& ray, const bvh_filter& filter, bool find_any,
+    bool non_rigid_frames) {
+  [[maybe_unused]] auto counter = bvh_count_rays{1};
+
+  auto intersection = bvh_intersection{};
+  intersection.hit  = intersect_bvh(bvh, scene, ray, intersection.instance,
+      intersection.element, intersection.uv, intersection.distance, find_any,
+      non_rigid_frames, filter);
+  return intersection;
+}
 bvh_intersection intersect_bvh(const bvh_data& bvh, const scene_data& scene,
     int instance, const ray3f& ray, bool find_any, bool non_rigid_frames) {
+  [[maybe_unused]] auto counter = bvh_count_rays{1};
+
   auto intersection     = bvh_intersection{};
   intersection.hit      = intersect_bvh(bvh, scene, instance, ray,
       intersection.element, intersection.uv, intersection.distance, find_any,
@@ -1111,10 +3272,145 @@ bvh_intersection intersect_bvh(const bvh_data& bvh, const scene_data& scene,
   intersection.instance = instance;
   return intersection;
 }
+// Intersect a packet of rays with a bvh. Hits rejected by `filter(ray,
+// instance, element, uv)`, with the index of the ray in the packet, are
+// skipped.
+template <size_t N, typename Filter = bvh_accept_hits>
+static array<bvh_intersection, N> intersect_packet(const bvh_data& bvh,
+    const scene_data& scene, const array<ray3f, N>& rays,
+    bool non_rigid_frames, Filter&& filter = {}) {
+  static_assert(N == 4 || N == 8 || N == 16, "unsupported packet size");
+  auto intersections = array<bvh_intersection, N>{};
+
+  // rays are traced one at a time if they do not share an octant, or if
+  // the bvh is not ours
+  auto coherent = true;
+  for (auto& ray : rays) {
+    for (auto axis = 0; axis < 3; axis++) {
+      if ((ray.d[axis] < 0) != (rays[0].d[axis] < 0)) coherent = false;
+    }
+  }
+#ifdef YOCTO_EMBREE
+  if (bvh.embree_bvh) coherent = false;
+#endif
+  if (!coherent) {
+    for (auto idx = 0; idx < (int)N; idx++) {
+      [[maybe_unused]] auto counter = bvh_count_rays{1};
+
+      auto ray_filter = [&](int instance, int element, const vec2f& uv) {
+        return filter(idx, instance, element, uv);
+      };
+      auto& intersection = intersections[idx];
+      intersection.hit   = intersect_bvh(bvh, scene, rays[idx],
+          intersection.instance, intersection.element, intersection.uv,
+          intersection.distance, false, non_rigid_frames, ray_filter);
+    }
+    return intersections;
+  }
+
+  // trace the packet
+  [[maybe_unused]] auto counter = bvh_count_rays{(int)N};
+
+  auto packet  = bvh_packet<N>{};
+  for (auto idx = 0; idx < (int)N; idx++) set_ray(packet, idx, rays[idx]);
+  auto instances = array<int, N>{};
+  auto elements  = array<int, N>{};
+  auto uvs       = array<vec2f, N>{};
+  auto distances = array<float, N>{};
+  auto hits = intersect_bvh(bvh, scene, packet, (uint32_t)((1ull << N) - 1),
+      instances, elements, uvs, distances, non_rigid_frames, filter);
+  for (auto idx = 0; idx < (int)N; idx++) {
+    if ((hits & (1u << idx)) == 0) continue;
+    intersections[idx] = {
+        instances[idx], elements[idx], uvs[idx], distances[idx], true};
+  }
+  return intersections;
+}
+
+// Size of the packets a ray stream is traced in.
+const auto bvh_stream_packet = 16;
+
+// Intersect a stream of rays with a bvh. Hits rejected by `filter(ray,
+// instance, element, uv)`, with the index of the ray in the stream, are
+// skipped.
+template <typename Filter = bvh_accept_hits>
+static void intersect_stream(const bvh_data& bvh, const scene_data& scene,
+    const vector<ray3f>& rays, vector<bvh_intersection>& intersections,
+    bool non_rigid_frames, Filter&& filter = {}) {
+  intersections.assign(rays.size(), bvh_intersection{});
+  if (rays.empty()) return;
+
+  // sort rays
+  auto order = sort_rays(rays);
+
+  // trace consecutive rays as packets, padding the last one
+  auto packet = array<ray3f, bvh_stream_packet>{};
+  auto ids    = array<int, bvh_stream_packet>{};
+  for (auto start = 0; start < (int)order.size(); start += bvh_stream_packet) {
+    auto count = min(bvh_stream_packet, (int)order.size() - start);
+    for (auto idx = 0; idx < bvh_stream_packet; idx++) {
+      ids[idx]    = order[start + min(idx, count - 1)];
+      packet[idx] = rays[ids[idx]];
+    }
+    auto packet_filter = [&](int ray, int instance, int element,
+                             const vec2f& uv) {
+      return filter(ids[ray], instance, element, uv);
+    };
+    auto packet_intersections = intersect_packet(
+        bvh, scene, packet, non_rigid_frames, packet_filter);
+    for (auto idx = 0; idx < count; idx++) {
+      intersections[ids[idx]] = packet_intersections[idx];
+    }
+  }
+}
+
+template <size_t N>
+array<bvh_intersection, N> intersect_bvh(const bvh_data& bvh,
+    const scene_data& scene, const array<ray3f, N>& rays,
+    bool non_rigid_frames) {
+  return intersect_packet(bvh, scene, rays, non_rigid_frames);
+}
+template <size_t N>
+array<bvh_intersection, N> intersect_bvh(const bvh_data& bvh,
+    const scene_data& scene, const array<ray3f, N>& rays,
+    const bvh_stream_filter& filter, bool non_rigid_frames) {
+  return intersect_packet(bvh, scene, rays, non_rigid_frames, filter);
+}
+template array<bvh_intersection, 4> intersect_bvh<4>(const bvh_data& bvh,
+    const scene_data& scene, const array<ray3f, 4>& rays,
+    bool non_rigid_frames);
+template array<bvh_intersection, 8> intersect_bvh<8>(const bvh_data& bvh,
+    const scene_data& scene, const array<ray3f, 8>& rays,
+    bool non_rigid_frames);
+template array<bvh_intersection, 16> intersect_bvh<16>(const bvh_data& bvh,
+    const scene_data& scene, const array<ray3f, 16>& rays,
+    bool non_rigid_frames);
+template array<bvh_intersection, 4> intersect_bvh<4>(const bvh_data& bvh,
+    const scene_data& scene, const array<ray3f, 4>& rays,
+    const bvh_stream_filter& filter, bool non_rigid_frames);
+template array<bvh_intersection, 8> intersect_bvh<8>(const bvh_data& bvh,
+    const scene_data& scene, const array<ray3f, 8>& rays,
+    const bvh_stream_filter& filter, bool non_rigid_frames);
+template array<bvh_intersection, 16> intersect_bvh<16>(const bvh_data& bvh,
+    const scene_data& scene, const array<ray3f, 16>& rays,
+    const bvh_stream_filter& filter, bool non_rigid_frames);
+
+void intersect_bvh(const bvh_data& bvh, const scene_data& scene,
+    const vector<ray3f>& rays, vector<bvh_intersection>& intersections,
+    bool non_rigid_frames) {
+  intersect_stream(bvh, scene, rays, intersections, non_rigid_frames);
+}
+void intersect_bvh(const bvh_data& bvh, const scene_data& scene,
+    const vector<ray3f>& rays, vector<bvh_intersection>& intersections,
+    const bvh_stream_filter& filter, bool non_rigid_frames) {
+  intersect_stream(bvh, scene, rays, intersections, non_rigid_frames, filter);
+}
 
 bvh_intersection overlap_bvh(const bvh_data& bvh, const scene_data& scene,
     const vec3f& pos, float max_distance, bool find_any,
     bool non_rigid_frames) {
+  [[maybe_unused]] auto counter = bvh_count_rays{1};
+
   auto intersection = bvh_intersection{};
   intersection.hit  = overlap_bvh(bvh, scene, pos, max_distance,
       intersection.instance, intersection.element, intersection.uv,
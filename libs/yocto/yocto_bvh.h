@@ -40,6 +40,7 @@
 
 #include <array>
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <string>
 #include <vector>
@@ -55,6 +56,8 @@ namespace yocto {
 
 // using directives
 using std::array;
+using std::function;
+using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
 using std::vector;
@@ -78,30 +81,109 @@ struct bvh_node {
   bool    internal = false;
 };
 
+// Wide BVH node storing the bounds of up to four children in SoA layout, so
+// that a ray can be tested against all of them at once. Children are either
+// other wide nodes, for internal children, or ranges of the primitive array,
+// for leaves. Wide nodes are built by collapsing the binary tree.
+struct alignas(16) bvh_node4 {
+  array<array<float, 4>, 3> min      = {};  // children min, per axis
+  array<array<float, 4>, 3> max      = {};  // children max, per axis
+  array<int32_t, 4>         start    = {};
+  array<int16_t, 4>         num      = {};
+  array<bool, 4>            internal = {};
+  int8_t                    count    = 0;
+};
+
+// Triangle stored in a BVH, with its first vertex and its two edges, so that
+// ray tests need not look up the shape elements and vertices. Quads are
+// stored as two triangles.
+struct bvh_triangle {
+  vec3f p0 = {0, 0, 0};
+  vec3f e1 = {0, 0, 0};
+  vec3f e2 = {0, 0, 0};
+};
+
+// Options for building the bvh.
+struct bvh_params {
+  bool   highquality = false;  // split with the SAH heuristic
+  bool   embree      = false;  // use Intel Embree, if available
+  bool   noparallel  = false;  // build shapes serially
+  bool   wide        = false;  // collapse nodes to 4-wide for traversal
+  bool   triangles   = false;  // store triangles and quads in leaf order
+  bool   linear      = false;  // split by Morton codes, for fast rebuilds
+  bool   spatial     = false;  // split triangles in space, as in SBVH
+  bool   lazy        = false;  // build shape bvhs when first reached
+  string cache       = "";     // directory of cached shape bvhs, if any
+  float  rebuild     = 1.5f;   // SAH cost growth that rebuilds on updates
+};
+
+// Lazy build state of the shape bvhs of a scene bvh.
+struct bvh_lazy;
+
 // BVH tree stored as a node array with the tree structure is encoded using
 // array indices. BVH nodes indices refer to either the node array,
 // for internal nodes, or the primitive arrays, for leaf nodes.
-// For instance BVHs, we also store the BVH of the contained shapes.
+// For instance BVHs, we also store the BVH of the contained shapes and the
+// inverse of the instance frames, used to transform rays during traversal.
 // Application data is not stored explicitly.
+// The binary nodes may be collapsed into wide nodes, used for traversal.
+// Shape BVHs may also store their triangles in leaf order.
+// Instance BVHs keep the links and costs used to refit them incrementally,
+// and the options used to rebuild them. Lazy instance BVHs keep their shape
+// BVHs in `lazy` and build them when a ray first reaches them, while tasks
+// on the shared thread pool warm the others, so the scene must outlive them
+// and should not be edited while they warm.
 // Additionally, we support the use of Intel Embree.
 struct bvh_data {
-  vector<bvh_node>                  nodes      = {};
-  vector<int>                       primitives = {};
-  vector<bvh_data>                  shapes     = {};                  // shapes
+  vector<bvh_node>                  nodes          = {};
+  vector<bvh_node4>                 wide_nodes     = {};  // wide nodes
+  vector<int>                       primitives     = {};
+  vector<bvh_triangle>              triangles      = {};  // leaf triangles
+  vector<bvh_data>                  shapes         = {};  // shapes
+  vector<frame3f>                   inverse_frames = {};  // instance frames
+  vector<int>                       parents        = {};  // node parents
+  vector<int>                       leaves         = {};  // instance leaves
+  vector<vec2i>                     wide_slots     = {};  // node wide slots
+  double                            cost           = 0;   // SAH node costs
+  double                            build_cost     = 0;   // SAH cost at build
+  bvh_params                        params         = {};  // build options
+  shared_ptr<bvh_lazy>              lazy           = {};  // lazy shapes
   unique_ptr<void, void (*)(void*)> embree_bvh = {nullptr, nullptr};  // embree
 };
 
 // Build the bvh acceleration structure.
+bvh_data make_bvh(const shape_data& shape, const bvh_params& params);
+bvh_data make_bvh(const scene_data& scene, const bvh_params& params);
 bvh_data make_bvh(
     const shape_data& shape, bool highquality = false, bool embree = false);
 bvh_data make_bvh(const scene_data& scene, bool highquality = false,
     bool embree = false, bool noparallel = false);
 
-// Refit bvh data
+// Refit bvh data. For scenes, updated shapes are refitted in parallel, and
+// only the instance nodes above updated instances, or instances of updated
+// shapes, are refitted. The instance bvh is rebuilt instead when its SAH
+// cost grows past `rebuild` times the one it was built with.
 void update_bvh(bvh_data& bvh, const shape_data& shape);
 void update_bvh(bvh_data& bvh, const scene_data& scene,
     const vector<int>& updated_instances, const vector<int>& updated_shapes);
 
+// Bvh statistics, including the memory used by each part and the quality
+// of the trees: their SAH cost, how full their leaves are and the
+// histogram of the depths of their leaves.
+vector<string> bvh_stats(const bvh_data& bvh);
+
+// Hash of a shape geometry and of the options its bvh depends on. This is
+// the key of the bvh cache, whose entries are named by it.
+uint64_t bvh_hash(const shape_data& shape, const bvh_params& params);
+
+// Save and load a shape bvh to a binary file, tagged with a hash. Loading
+// fails if the hash differs or the file was written by a different format
+// version, so that stale entries are detected. Loads are memory-mapped.
+bool save_bvh(const string& filename, const bvh_data& bvh, uint64_t hash,
+    string& error);
+bool load_bvh(
+    const string& filename, bvh_data& bvh, uint64_t hash, string& error);
+
 // Results of intersect_xxx and overlap_xxx functions that include hit flag,
 // instance id, shape element id, shape element uv and intersection distance.
 // The values are all set for scene intersection. Shape intersection does not
@@ -126,6 +208,62 @@ bvh_intersection intersect_bvh(const bvh_data& bvh, const scene_data& scene,
     int instance, const ray3f& ray, bool find_any = false,
     bool non_rigid_frames = true);
 
+// Filter of the candidate hits of a ray, returning whether a hit is accepted.
+// Rejected hits are skipped during traversal, as if the surface was not
+// there, which is how alpha testing is done.
+using bvh_filter = function<bool(int instance, int element, const vec2f& uv)>;
+
+// Intersect ray with a bvh, skipping the hits rejected by a filter.
+bvh_intersection intersect_bvh(const bvh_data& bvh, const scene_data& scene,
+    const ray3f& ray, const bvh_filter& filter, bool find_any = false,
+    bool non_rigid_frames = true);
+
+// Filter of the candidate hits of the rays of a packet or stream, given
+// also the index of the ray in the packet or stream, so that each ray can
+// accept hits differently.
+using bvh_stream_filter =
+    function<bool(int ray, int instance, int element, const vec2f& uv)>;
+
+// Intersect a packet of rays with a bvh returning the first intersection of
+// each ray. Rays are traced together, sharing a node stack and testing node
+// bounds for all rays at once, so they should be coherent, like camera rays
+// of nearby pixels. Rays that do not share a direction octant, or whose
+// packet diverges during traversal, are traced one at a time. Packets of
+// 4, 8 and 16 rays are supported. Hits rejected by a filter are skipped
+// during traversal.
+template <size_t N>
+array<bvh_intersection, N> intersect_bvh(const bvh_data& bvh,
+    const scene_data& scene, const array<ray3f, N>& rays,
+    bool non_rigid_frames = true);
+template <size_t N>
+array<bvh_intersection, N> intersect_bvh(const bvh_data& bvh,
+    const scene_data& scene, const array<ray3f, N>& rays,
+    const bvh_stream_filter& filter, bool non_rigid_frames = true);
+
+// Intersect a stream of rays with a bvh, setting the first intersection of
+// each ray. Rays are sorted by direction octant and origin, then traced in
+// packets of nearby rays, so that incoherent rays, like the ones of a whole
+// bounce, share node and primitive accesses. Hits rejected by a filter are
+// skipped during traversal.
+void intersect_bvh(const bvh_data& bvh, const scene_data& scene,
+    const vector<ray3f>& rays, vector<bvh_intersection>& intersections,
+    bool non_rigid_frames = true);
+void intersect_bvh(const bvh_data& bvh, const scene_data& scene,
+    const vector<ray3f>& rays, vector<bvh_intersection>& intersections,
+    const bvh_stream_filter& filter, bool non_rigid_frames = true);
+
+// Check whether a ray hits a bvh, for shadow and visibility rays. Traversal
+// stops at the first primitive hit and no hit data is computed. Rays are
+// tested in the given order by the batched version, since sorting costs more
+// than it saves for any-hit queries.
+bool occluded_bvh(
+    const bvh_data& bvh, const shape_data& shape, const ray3f& ray);
+bool occluded_bvh(const bvh_data& bvh, const scene_data& scene,
+    const ray3f& ray, bool non_rigid_frames = true);
+void occluded_bvh(const bvh_data& bvh, const scene_data& scene,
+    const vector<ray3f>& rays, vector<bool>& occluded,
+    bool non_rigid_frames = true);
+
 // Find a shape element that overlaps a point within a given distance
 // max distance, returning either the closest or any overlap depending on
 // `find_any`. Returns the point distance, the instance id, the shape element
@@ -138,6 +276,56 @@ bvh_intersection overlap_bvh(const bvh_data& bvh, const scene_data& scene,
 
 }  // namespace yocto
 
+// -----------------------------------------------------------------------------
+// BVH TRAVERSAL COUNTERS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Whether queries count their work, which is enabled by building with
+// YOCTO_BVH_STATS. Otherwise, counting is compiled out and counters are zero.
+#ifdef YOCTO_BVH_STATS
+const auto bvh_counting = true;
+#else
+const auto bvh_counting = false;
+#endif
+
+// Work done by bvh queries. Packets count all their rays, but their nodes
+// and primitives once. The stack depth is the deepest node stack reached.
+struct bvh_counters {
+  uint64_t rays       = 0;  // rays, or points for overlap queries
+  uint64_t nodes      = 0;  // nodes visited
+  uint64_t instances  = 0;  // instances visited
+  uint64_t primitives = 0;  // primitives tested
+  uint64_t depth      = 0;  // sum of the stack depths of the rays
+  uint64_t max_depth  = 0;  // max stack depth of the rays
+};
+
+// Number of groups counters are split into, so that callers can count
+// different kinds of rays separately.
+const auto bvh_counter_groups = 4;
+
+// Counters of each group.
+using bvh_group_counters = array<bvh_counters, bvh_counter_groups>;
+
+// Set the counter group the calling thread counts into, returning the
+// previous one. Threads start counting into group 0.
+int set_bvh_counter_group(int group);
+
+// Counters of the calling thread. Each thread counts on its own, so that
+// counting needs no synchronization. Reading them is cheap, so callers can
+// measure a set of queries by the difference of the counters around them.
+const bvh_group_counters& get_bvh_thread_counters();
+
+// Counters summed over all threads, including the finished ones, and their
+// reset. Call these when no query is running.
+bvh_group_counters get_bvh_counters();
+void               reset_bvh_counters();
+
+// Statistics of the counters, as totals and averages per ray.
+vector<string> bvh_stats(const bvh_counters& counters);
+
+}  // namespace yocto
+
 // -----------------------------------------------------------------------------
 // BACKWARDS COMPATIBILITY
 // -----------------------------------------------------------------------------
@@ -777,14 +777,24 @@ static string schema_to_usage(
                                        (string)oschema["cliconfig"]);
       }
     } else {
-      auto name = string{};
+      auto name    = string{};
+      auto negated = false;
       for (auto& [key, value] : schema["properties"].items()) {
         if ("--" + key == arg && value.at("type") != "object") {
           name = key;
           break;
         }
+        if ("--no-" + key == arg && value.at("type") == "boolean") {
+          name    = key;
+          negated = true;
+          break;
+        }
       }
       if (name == "") return cli_error("unknown option " + arg);
+      if (negated) {
+        value[name] = false;
+        continue;
+      }
       auto& oschema = schema["properties"][name];
       if (!arg_to_json(
               value[name], oschema, name, is_positional, args, idx, error))
@@ -37,9 +37,14 @@
 // INCLUDES
 // -----------------------------------------------------------------------------
 
+#include <algorithm>
 #include <atomic>
+#include <condition_variable>
 #include <deque>
+#include <exception>
+#include <functional>
 #include <future>
+#include <memory>
 #include <mutex>
 #include <thread>
 #include <utility>
@@ -53,6 +58,7 @@ namespace yocto {
 // using directives
 using std::atomic;
 using std::deque;
+using std::function;
 using std::future;
 using std::mutex;
 using std::vector;
@@ -81,6 +87,30 @@ struct concurrent_queue {
   deque<T>   queue;
 };
 
+// A pool of persistent worker threads that run queued tasks. The parallel
+// algorithms below share a single pool, created lazily on first use,
+// so that each call only pays for waking up threads and not for creating them.
+struct thread_pool {
+  thread_pool(int nworkers);
+  ~thread_pool();
+  thread_pool(const thread_pool& other) = delete;
+  thread_pool& operator=(const thread_pool& other) = delete;
+
+  int  size() const;
+  void push(const function<void()>& task, int copies = 1);
+
+ private:
+  vector<std::thread>     workers = {};
+  deque<function<void()>> tasks   = {};
+  std::mutex              mutex;
+  std::condition_variable ready;
+  bool                    stop = false;
+};
+
+// Get the thread pool shared by the parallel algorithms. The pool has one
+// worker less than the hardware threads, since callers join in the work.
+inline thread_pool& get_thread_pool();
+
 // Run a task asynchronously
 template <typename Func, typename... Args>
 inline auto run_async(Func&& func, Args&&... args);
@@ -166,6 +196,95 @@ bool concurrent_queue<T>::try_pop(T& value) {
   return true;
 }
 
+// Thread pool
+inline thread_pool::thread_pool(int nworkers) {
+  for (auto worker = 0; worker < nworkers; worker++) {
+    workers.emplace_back([this]() {
+      while (true) {
+        auto task = function<void()>{};
+        {
+          auto lock = std::unique_lock{mutex};
+          ready.wait(lock, [this]() { return stop || !tasks.empty(); });
+          if (stop) return;
+          task = std::move(tasks.front());
+          tasks.pop_front();
+        }
+        task();
+      }
+    });
+  }
+}
+inline thread_pool::~thread_pool() {
+  {
+    auto lock = std::lock_guard{mutex};
+    stop      = true;
+  }
+  ready.notify_all();
+  for (auto& worker : workers) worker.join();
+}
+inline int  thread_pool::size() const { return (int)workers.size(); }
+inline void thread_pool::push(const function<void()>& task, int copies) {
+  if (copies <= 0) return;
+  {
+    auto lock = std::lock_guard{mutex};
+    for (auto copy = 0; copy < copies; copy++) tasks.push_back(task);
+  }
+  if (copies == 1) {
+    ready.notify_one();
+  } else {
+    ready.notify_all();
+  }
+}
+
+// Get the shared thread pool
+inline thread_pool& get_thread_pool() {
+  static auto pool = thread_pool{
+      std::max((int)std::thread::hardware_concurrency(), 1) - 1};
+  return pool;
+}
+
+// Runs `body` on the calling thread and on all pool workers, and returns when
+// all the running copies are done. Workers that start after the caller is
+// done do not run `body`, so callers never wait on queued tasks. This makes
+// nested calls safe, since the caller alone can always finish the work.
+// The first exception thrown by `body` is rethrown to the caller.
+struct _parallel_job {
+  std::mutex              mutex;
+  std::condition_variable done;
+  int                     running = 0;
+  bool                    closed  = false;
+  std::exception_ptr      error   = nullptr;
+};
+template <typename Func>
+inline void _parallel_run(Func&& body) {
+  auto job = std::make_shared<_parallel_job>();
+  auto run = [job, &body]() {
+    {
+      auto lock = std::lock_guard{job->mutex};
+      if (job->closed) return;
+      job->running += 1;
+    }
+    try {
+      body();
+    } catch (...) {
+      auto lock = std::lock_guard{job->mutex};
+      if (!job->error) job->error = std::current_exception();
+    }
+    {
+      auto lock = std::lock_guard{job->mutex};
+      job->running -= 1;
+    }
+    job->done.notify_all();
+  };
+  auto& pool = get_thread_pool();
+  pool.push(run, pool.size());
+  run();
+  auto lock   = std::unique_lock{job->mutex};
+  job->closed = true;
+  job->done.wait(lock, [&job]() { return job->running == 0; });
+  if (job->error) std::rethrow_exception(job->error);
+}
+
 // Run a task asynchronously
 template <typename Func, typename... Args>
 inline auto run_async(Func&& func, Args&&... args) {
@@ -187,82 +306,64 @@ inline bool is_ready(const future<void>& result) {
 // parallel algorithms. `Func` takes the integer index.
 template <typename T, typename Func>
 inline void parallel_for(T num, Func&& func) {
-  auto         futures  = vector<future<void>>{};
-  auto         nthreads = std::thread::hardware_concurrency();
   atomic<T>    next_idx(0);
   atomic<bool> has_error(false);
-  for (auto thread_id = 0; thread_id < (int)nthreads; thread_id++) {
-    futures.emplace_back(
-        std::async(std::launch::async, [&func, &next_idx, &has_error, num]() {
-          try {
-            while (true) {
-              auto idx = next_idx.fetch_add(1);
-              if (idx >= num) break;
-              if (has_error) break;
-              func(idx);
-            }
-          } catch (...) {
-            has_error = true;
-            throw;
-          }
-        }));
-  }
-  for (auto& f : futures) f.get();
+  _parallel_run([&func, &next_idx, &has_error, num]() {
+    try {
+      while (true) {
+        auto idx = next_idx.fetch_add(1);
+        if (idx >= num) break;
+        if (has_error) break;
+        func(idx);
+      }
+    } catch (...) {
+      has_error = true;
+      throw;
+    }
+  });
 }
 
 // Simple parallel for used since our target platforms do not yet support
 // parallel algorithms. `Func` takes the two integer indices.
 template <typename T, typename Func>
 inline void parallel_for(T num1, T num2, Func&& func) {
-  auto         futures  = vector<future<void>>{};
-  auto         nthreads = std::thread::hardware_concurrency();
   atomic<T>    next_idx(0);
   atomic<bool> has_error(false);
-  for (auto thread_id = 0; thread_id < (int)nthreads; thread_id++) {
-    futures.emplace_back(std::async(
-        std::launch::async, [&func, &next_idx, &has_error, num1, num2]() {
-          try {
-            while (true) {
-              auto j = next_idx.fetch_add(1);
-              if (j >= num2) break;
-              if (has_error) break;
-              for (auto i = (T)0; i < num1; i++) func(i, j);
-            }
-          } catch (...) {
-            has_error = true;
-            throw;
-          }
-        }));
-  }
-  for (auto& f : futures) f.get();
+  _parallel_run([&func, &next_idx, &has_error, num1, num2]() {
+    try {
+      while (true) {
+        auto j = next_idx.fetch_add(1);
+        if (j >= num2) break;
+        if (has_error) break;
+        for (auto i = (T)0; i < num1; i++) func(i, j);
+      }
+    } catch (...) {
+      has_error = true;
+      throw;
+    }
+  });
 }
 
 // Simple parallel for used since our target platforms do not yet support
 // parallel algorithms. `Func` takes the integer index.
 template <typename T, typename Func>
 inline void parallel_for_batch(T num, T batch, Func&& func) {
-  auto         futures  = vector<future<void>>{};
-  auto         nthreads = std::thread::hardware_concurrency();
   atomic<T>    next_idx(0);
   atomic<bool> has_error(false);
-  for (auto thread_id = 0; thread_id < (int)nthreads; thread_id++) {
-    futures.emplace_back(std::async(
-        std::launch::async, [&func, &next_idx, &has_error, num, batch]() {
-          try {
-            while (true) {
-              auto start = next_idx.fetch_add(batch);
-              if (start >= num) break;
-              if (has_error) break;
-              auto end = std::min(num, start + batch);
-              for (auto i = (T)start; i < end; i++) func(i);
-            }
-          } catch (...) {
-            has_error = true;
-            throw;
-          }
-        }));
-  }
-  for (auto& f : futures) f.get();
+  _parallel_run([&func, &next_idx, &has_error, num, batch]() {
+    try {
+      while (true) {
+        auto start = next_idx.fetch_add(batch);
+        if (start >= num) break;
+        if (has_error) break;
+        auto end = std::min(num, start + batch);
+        for (auto i = (T)start; i < end; i++) func(i);
+      }
+    } catch (...) {
+      has_error = true;
+      throw;
+    }
+  });
 }
 
 // Simple parallel for used since our target platforms do not yet support
@@ -282,29 +383,23 @@ inline void parallel_foreach(const vector<T>& values, Func&& func) {
 // parallel algorithms. `Func` takes the integer index.
 template <typename T, typename Func>
 inline bool parallel_for(T num, string& error, Func&& func) {
-  auto         futures  = vector<future<void>>{};
-  auto         nthreads = std::thread::hardware_concurrency();
   atomic<T>    next_idx(0);
   atomic<bool> has_error(false);
   mutex        error_mutex;
-  for (auto thread_id = 0; thread_id < (int)nthreads; thread_id++) {
-    futures.emplace_back(std::async(std::launch::async,
-        [&func, &next_idx, &has_error, &error_mutex, &error, num]() {
-          auto this_error = string{};
-          while (true) {
-            if (has_error) break;
-            auto idx = next_idx.fetch_add(1);
-            if (idx >= num) break;
-            if (!func(idx, this_error)) {
-              has_error = true;
-              auto _    = std::lock_guard{error_mutex};
-              error     = this_error;
-              break;
-            }
-          }
-        }));
-  }
-  for (auto& f : futures) f.get();
+  _parallel_run([&func, &next_idx, &has_error, &error_mutex, &error, num]() {
+    auto this_error = string{};
+    while (true) {
+      if (has_error) break;
+      auto idx = next_idx.fetch_add(1);
+      if (idx >= num) break;
+      if (!func(idx, this_error)) {
+        has_error = true;
+        auto _    = std::lock_guard{error_mutex};
+        error     = this_error;
+        break;
+      }
+    }
+  });
   return !(bool)has_error;
 }
 
@@ -48,6 +48,7 @@
 
 #include <algorithm>  // std::upper_bound
 #include <array>
+#include <string>
 #include <utility>
 #include <vector>
 
@@ -60,6 +61,7 @@ namespace yocto {
 
 // using directives
 using std::array;
+using std::string;
 using std::vector;
 
 }  // namespace yocto
@@ -91,6 +93,43 @@ inline vec3f rand3f(rng_state& rng);
 template <typename T>
 inline void shuffle(vector<T>& vals, rng_state& rng);
 
+// Counter-based random numbers, computed by hashing a seed, a pixel, a sample
+// index and a dimension. No state is stored and each number is computed on
+// its own, so the samples of a pixel are the same however they are split
+// among passes, tiles or machines. Pixels may be any other stream index.
+inline uint32_t hash_rand(
+    uint32_t seed, uint32_t pixel, uint32_t sample, uint32_t dimension);
+
+// Sequences of the numbers drawn for the samples of a pixel. Random numbers
+// are hashed. Sobol numbers are Owen-scrambled per pixel, so that the
+// samples of each pixel are well stratified. Blue noise numbers share a
+// scrambled Sobol sequence among all pixels, shifted in each pixel by a blue
+// noise mask, so that the error of nearby pixels is uncorrelated and looks
+// like high-frequency noise at low sample counts.
+enum struct sequence_type { random, sobol, bluenoise };
+
+const auto sequence_names = vector<string>{"random", "sobol", "bluenoise"};
+
+// Counter-based generator of the numbers of a pixel sample, that draws
+// consecutive dimensions, for code that draws numbers one after the other.
+struct counter_rng {
+  sequence_type type      = sequence_type::random;
+  uint32_t      seed      = 0;
+  vec2i         pixel     = {0, 0};
+  uint32_t      sample    = 0;
+  uint32_t      dimension = 0;
+};
+
+// Init a counter-based generator for a pixel sample.
+inline counter_rng make_counter_rng(uint32_t seed, const vec2i& pixel,
+    uint32_t sample, sequence_type type = sequence_type::random);
+
+// Next random numbers: floats in [0,1), ints in [0,n).
+inline int   rand1i(counter_rng& rng, int n);
+inline float rand1f(counter_rng& rng);
+inline vec2f rand2f(counter_rng& rng);
+inline vec3f rand3f(counter_rng& rng);
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -238,6 +277,253 @@ inline void shuffle(vector<T>& vals, rng_state& rng) {
   }
 }
 
+// Counter-based random numbers, using the pcg4d hash from Jarzynski and
+// Olano, "Hash Functions for GPU Rendering", JCGT 2020, followed by a final
+// mix of its outputs.
+inline uint32_t hash_rand(
+    uint32_t seed, uint32_t pixel, uint32_t sample, uint32_t dimension) {
+  auto x = pixel * 1664525u + 1013904223u;
+  auto y = sample * 1664525u + 1013904223u;
+  auto z = dimension * 1664525u + 1013904223u;
+  auto w = seed * 1664525u + 1013904223u;
+  x += y * w;
+  y += z * x;
+  z += x * y;
+  w += y * z;
+  x ^= x >> 16;
+  y ^= y >> 16;
+  z ^= z >> 16;
+  w ^= w >> 16;
+  x += y * w;
+  y += z * x;
+  z += x * y;
+  w += y * z;
+  return x ^ (z >> 16) ^ (w << 16);
+}
+
+// Direction numbers of the first four Sobol dimensions, from the primitive
+// polynomials and initial numbers of Joe and Kuo, with the most significant
+// bit first.
+inline constexpr array<array<uint32_t, 32>, 4> _sobol_directions() {
+  auto directions = array<array<uint32_t, 32>, 4>{};
+  auto degrees    = array<int, 4>{0, 1, 2, 3};
+  auto polys      = array<uint32_t, 4>{0, 0, 1, 1};
+  auto initials   = array<array<uint32_t, 3>, 4>{
+      {{0, 0, 0}, {1, 0, 0}, {1, 3, 0}, {1, 3, 1}}};
+  for (auto bit = 0; bit < 32; bit++) directions[0][bit] = 1u << (31 - bit);
+  for (auto dim = 1; dim < 4; dim++) {
+    auto  degree = degrees[dim];
+    auto& v      = directions[dim];
+    for (auto bit = 0; bit < 32; bit++) {
+      if (bit < degree) {
+        v[bit] = initials[dim][bit] << (31 - bit);
+        continue;
+      }
+      v[bit] = v[bit - degree] ^ (v[bit - degree] >> degree);
+      for (auto k = 1; k < degree; k++) {
+        if ((polys[dim] >> (degree - 1 - k)) & 1) v[bit] ^= v[bit - k];
+      }
+    }
+  }
+  return directions;
+}
+
+// Sobol number of a sample index in one of the first four dimensions.
+inline uint32_t _sobol(uint32_t index, int dimension) {
+  static constexpr auto directions = _sobol_directions();
+  auto                  result     = 0u;
+  for (auto bit = 0; index != 0; index >>= 1, bit++) {
+    if (index & 1) result ^= directions[dimension][bit];
+  }
+  return result;
+}
+
+// Reverse the bits of a number.
+inline uint32_t _reverse_bits(uint32_t x) {
+  x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+  x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+  x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+// Owen scrambling of a number, computed with the hash of Burley, "Practical
+// Hash-based Owen Scrambling", JCGT 2020.
+inline uint32_t _owen_scramble(uint32_t x, uint32_t seed) {
+  x = _reverse_bits(x);
+  x += seed;
+  x ^= x * 0x6c50b47cu;
+  x ^= x * 0xb82f1e52u;
+  x ^= x * 0xc7afe638u;
+  x ^= x * 0x8d22f6e6u;
+  return _reverse_bits(x);
+}
+
+// Owen-scrambled Sobol number of a sample. Dimensions are taken four at a
+// time from the first four Sobol dimensions, with the sample index shuffled
+// differently for each group of four, as done by Burley.
+inline uint32_t _sobol_rand(
+    uint32_t seed, uint32_t sample, uint32_t dimension) {
+  auto group = hash_rand(seed, dimension / 4, 0, 0xffffffffu);
+  auto index = _owen_scramble(sample, group);
+  return _owen_scramble(
+      _sobol(index, dimension % 4), hash_rand(group, dimension % 4, 0, 0));
+}
+
+// Blue noise mask, made with the void and cluster method of Ulichney, "The
+// void-and-cluster method for dither array generation", SPIE 1993. Values
+// are the ranks of the pixels, so they are uniform in [0,1). The mask is
+// made the first time it is used.
+const auto _bluenoise_size = 64;
+inline const vector<float>& _bluenoise_mask() {
+  static const auto mask = []() {
+    const auto size = _bluenoise_size, count = size * size;
+    // gaussian energy of each pixel, wrapped around the mask borders
+    auto kernel = vector<float>(count);
+    for (auto j = 0; j < size; j++) {
+      for (auto i = 0; i < size; i++) {
+        auto dx = (float)std::min(i, size - i);
+        auto dy = (float)std::min(j, size - j);
+        kernel[j * size + i] = std::exp(-(dx * dx + dy * dy) / 4.5f);
+      }
+    }
+    auto set_pixel = [&](vector<bool>& pattern, vector<float>& energy,
+                         int idx, bool value) {
+      pattern[idx] = value;
+      auto pi = idx % size, pj = idx / size;
+      auto sign = value ? 1.0f : -1.0f;
+      for (auto j = 0; j < size; j++) {
+        auto row = ((j - pj + size) % size) * size;
+        for (auto i = 0; i < size; i++) {
+          energy[j * size + i] += sign * kernel[row + (i - pi + size) % size];
+        }
+      }
+    };
+    // tightest cluster of ones, or largest void among zeros
+    auto find_pixel = [&](const vector<bool>& pattern,
+                          const vector<float>& energy, bool cluster) {
+      auto best = -1;
+      for (auto idx = 0; idx < count; idx++) {
+        if (pattern[idx] != cluster) continue;
+        if (best < 0 || (cluster ? energy[idx] > energy[best]
+                                 : energy[idx] < energy[best]))
+          best = idx;
+      }
+      return best;
+    };
+
+    // initial pattern, with ones moved from clusters to voids until stable
+    auto pattern = vector<bool>(count, false);
+    auto energy  = vector<float>(count, 0);
+    auto rng     = make_rng(1301081);
+    auto ones    = count / 10;
+    for (auto placed = 0; placed < ones;) {
+      auto idx = rand1i(rng, count);
+      if (pattern[idx]) continue;
+      set_pixel(pattern, energy, idx, true);
+      placed++;
+    }
+    while (true) {
+      auto cluster = find_pixel(pattern, energy, true);
+      set_pixel(pattern, energy, cluster, false);
+      auto empty = find_pixel(pattern, energy, false);
+      set_pixel(pattern, energy, empty, true);
+      if (empty == cluster) break;
+    }
+
+    // rank the initial ones by removing clusters, then the others by
+    // filling voids
+    auto ranks           = vector<int>(count, 0);
+    auto removed_pattern = pattern;
+    auto removed_energy  = energy;
+    for (auto rank = ones - 1; rank >= 0; rank--) {
+      auto cluster = find_pixel(removed_pattern, removed_energy, true);
+      set_pixel(removed_pattern, removed_energy, cluster, false);
+      ranks[cluster] = rank;
+    }
+    for (auto rank = ones; rank < count; rank++) {
+      auto empty = find_pixel(pattern, energy, false);
+      set_pixel(pattern, energy, empty, true);
+      ranks[empty] = rank;
+    }
+
+    auto mask = vector<float>(count);
+    for (auto idx = 0; idx < count; idx++) {
+      mask[idx] = (ranks[idx] + 0.5f) / count;
+    }
+    return mask;
+  }();
+  return mask;
+}
+
+// Blue noise dithered number of a sample, as in Georgiev and Fajardo, "Blue
+// noise dithered sampling", SIGGRAPH 2016 Talks. The mask is offset for
+// each dimension, so that dimensions are not correlated.
+inline float _bluenoise_rand(const counter_rng& rng) {
+  auto& mask   = _bluenoise_mask();
+  auto  offset = hash_rand(rng.seed, rng.dimension, 0, 0xfffffffeu);
+  auto  i = (rng.pixel.x + (int)(offset & 0xffffu)) % _bluenoise_size;
+  auto  j = (rng.pixel.y + (int)(offset >> 16)) % _bluenoise_size;
+  auto  value = (_sobol_rand(rng.seed, rng.sample, rng.dimension) >> 8) /
+                16777216.0f +
+               mask[j * _bluenoise_size + i];
+  return value < 1 ? value : std::min(value - 1, 1 - 1 / 16777216.0f);
+}
+
+// Init a counter-based generator for a pixel sample.
+inline counter_rng make_counter_rng(uint32_t seed, const vec2i& pixel,
+    uint32_t sample, sequence_type type) {
+  return {type, seed, pixel, sample, 0};
+}
+
+// Next random numbers: floats in [0,1), ints in [0,n). Pixels are hashed
+// as a single key, which is unique for images up to 65536 pixels wide.
+inline int rand1i(counter_rng& rng, int n) {
+  if (rng.type != sequence_type::random) {
+    return std::min((int)(rand1f(rng) * n), n - 1);
+  }
+  auto key = (uint32_t)rng.pixel.y * 65536u + (uint32_t)rng.pixel.x;
+  return hash_rand(rng.seed, key, rng.sample, rng.dimension++) % n;
+}
+inline float rand1f(counter_rng& rng) {
+  auto key   = (uint32_t)rng.pixel.y * 65536u + (uint32_t)rng.pixel.x;
+  auto value = 0u;
+  switch (rng.type) {
+    case sequence_type::random:
+      value = hash_rand(rng.seed, key, rng.sample, rng.dimension);
+      break;
+    case sequence_type::sobol:
+      value = _sobol_rand(
+          hash_rand(rng.seed, key, 0, 0xfffffffdu), rng.sample, rng.dimension);
+      break;
+    case sequence_type::bluenoise: {
+      auto result = _bluenoise_rand(rng);
+      rng.dimension++;
+      return result;
+    }
+  }
+  rng.dimension++;
+  union {
+    uint32_t u;
+    float    f;
+  } x;
+  x.u = (value >> 9) | 0x3f800000u;
+  return x.f - 1.0f;
+}
+inline vec2f rand2f(counter_rng& rng) {
+  // force order of evaluation by using separate assignments.
+  auto x = rand1f(rng);
+  auto y = rand1f(rng);
+  return {x, y};
+}
+inline vec3f rand3f(counter_rng& rng) {
+  // force order of evaluation by using separate assignments.
+  auto x = rand1f(rng);
+  auto y = rand1f(rng);
+  auto z = rand1f(rng);
+  return {x, y, z};
+}
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
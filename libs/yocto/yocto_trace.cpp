@@ -52,8 +52,8 @@ namespace yocto {
 
 // Build the bvh acceleration structure.
 bvh_data make_bvh(const scene_data& scene, const trace_params& params) {
-  return make_bvh(
-      scene, params.highqualitybvh, params.embreebvh, params.noparallel);
+  return make_bvh(scene, bvh_params{params.highqualitybvh, params.embreebvh,
+                             params.noparallel, params.widebvh});
 }
 
 }  // namespace yocto
@@ -300,7 +300,7 @@ static ray3f sample_camera(const camera_data& camera, const vec2i& ij,
 }
 
 // Sample lights wrt solid angle
-static vec3f sample_lights(const scene_data& scene, const trace_lights& lights,
+vec3f sample_lights(const scene_data& scene, const trace_lights& lights,
     const vec3f& position, float rl, float rel, const vec2f& ruv) {
   auto  light_id = sample_uniform((int)lights.lights.size(), rl);
   auto& light    = lights.lights[light_id];
@@ -330,7 +330,7 @@ static vec3f sample_lights(const scene_data& scene, const trace_lights& lights,
 }
 
 // Sample lights pdf
-static float sample_lights_pdf(const scene_data& scene, const bvh_data& bvh,
+float sample_lights_pdf(const scene_data& scene, const bvh_data& bvh,
     const trace_lights& lights, const vec3f& position, const vec3f& direction) {
   auto pdf = 0.0f;
   for (auto& light : lights.lights) {
@@ -393,7 +393,7 @@ struct trace_result {
 
 // Recursive path tracing.
 static trace_result trace_path(const scene_data& scene, const bvh_data& bvh,
-    const trace_lights& lights, const ray3f& ray_, rng_state& rng,
+    const trace_lights& lights, const ray3f& ray_, counter_rng& rng,
     const trace_params& params) {
   // initialize
   auto radiance      = vec3f{0, 0, 0};
@@ -540,7 +540,7 @@ static trace_result trace_path(const scene_data& scene, const bvh_data& bvh,
 // Recursive path tracing.
 static trace_result trace_pathdirect(const scene_data& scene,
     const bvh_data& bvh, const trace_lights& lights, const ray3f& ray_,
-    rng_state& rng, const trace_params& params) {
+    counter_rng& rng, const trace_params& params) {
   // initialize
   auto radiance      = vec3f{0, 0, 0};
   auto weight        = vec3f{1, 1, 1};
@@ -710,7 +710,7 @@ static trace_result trace_pathdirect(const scene_data& scene,
 
 // Recursive path tracing with MIS.
 static trace_result trace_pathmis(const scene_data& scene, const bvh_data& bvh,
-    const trace_lights& lights, const ray3f& ray_, rng_state& rng,
+    const trace_lights& lights, const ray3f& ray_, counter_rng& rng,
     const trace_params& params) {
   // initialize
   auto radiance      = vec3f{0, 0, 0};
@@ -892,7 +892,7 @@ static trace_result trace_pathmis(const scene_data& scene, const bvh_data& bvh,
 
 // Recursive path tracing.
 static trace_result trace_naive(const scene_data& scene, const bvh_data& bvh,
-    const trace_lights& lights, const ray3f& ray_, rng_state& rng,
+    const trace_lights& lights, const ray3f& ray_, counter_rng& rng,
     const trace_params& params) {
   // initialize
   auto radiance   = vec3f{0, 0, 0};
@@ -971,7 +971,7 @@ static trace_result trace_naive(const scene_data& scene, const bvh_data& bvh,
 
 // Eyelight for quick previewing.
 static trace_result trace_eyelight(const scene_data& scene, const bvh_data& bvh,
-    const trace_lights& lights, const ray3f& ray_, rng_state& rng,
+    const trace_lights& lights, const ray3f& ray_, counter_rng& rng,
     const trace_params& params) {
   // initialize
   auto radiance   = vec3f{0, 0, 0};
@@ -1039,7 +1039,7 @@ static trace_result trace_eyelight(const scene_data& scene, const bvh_data& bvh,
 // Eyelight with ambient occlusion for quick previewing.
 static trace_result trace_eyelightao(const scene_data& scene,
     const bvh_data& bvh, const trace_lights& lights, const ray3f& ray_,
-    rng_state& rng, const trace_params& params) {
+    counter_rng& rng, const trace_params& params) {
   // initialize
   auto radiance   = vec3f{0, 0, 0};
   auto weight     = vec3f{1, 1, 1};
@@ -1086,7 +1086,7 @@ static trace_result trace_eyelightao(const scene_data& scene,
 
     // occlusion
     auto occluding = sample_hemisphere_cos(normal, rand2f(rng));
-    if (intersect_bvh(bvh, scene, {position, occluding}).hit) break;
+    if (occluded_bvh(bvh, scene, {position, occluding})) break;
 
     // brdf * light
     radiance += weight * pif *
@@ -1109,7 +1109,7 @@ static trace_result trace_eyelightao(const scene_data& scene,
 
 // Furnace test.
 static trace_result trace_furnace(const scene_data& scene, const bvh_scene& bvh,
-    const trace_lights& lights, const ray3f& ray_, rng_state& rng,
+    const trace_lights& lights, const ray3f& ray_, counter_rng& rng,
     const trace_params& params) {
   // initialize
   auto radiance   = zero3f;
@@ -1204,7 +1204,7 @@ static trace_result trace_furnace(const scene_data& scene, const bvh_scene& bvh,
 // False color rendering
 static trace_result trace_falsecolor(const scene_data& scene,
     const bvh_data& bvh, const trace_lights& lights, const ray3f& ray,
-    rng_state& rng, const trace_params& params) {
+    counter_rng& rng, const trace_params& params) {
   // intersect next point
   auto intersection = intersect_bvh(bvh, scene, ray);
   if (!intersection.hit) return {};
@@ -1285,7 +1285,7 @@ static trace_result trace_falsecolor(const scene_data& scene,
 // Trace a single ray from the camera using the given algorithm.
 using sampler_func = trace_result (*)(const scene_data& scene,
     const bvh_data& bvh, const trace_lights& lights, const ray3f& ray,
-    rng_state& rng, const trace_params& params);
+    counter_rng& rng, const trace_params& params);
 static sampler_func get_trace_sampler_func(const trace_params& params) {
   switch (params.sampler) {
     case trace_sampler_type::path: return trace_path;
@@ -1321,31 +1321,50 @@ bool is_sampler_lit(const trace_params& params) {
   }
 }
 
-// Trace a block of samples
+// Number of samples per pixel added by the next pass, given the batch size.
+static int trace_batch(const trace_state& state, const trace_params& params) {
+  return clamp(params.batch, 1, max(params.samples - state.samples, 1));
+}
+
+// Trace a block of samples. The batch is summed locally before it is added
+// to the pixel.
 void trace_sample(trace_state& state, const scene_data& scene,
     const bvh_data& bvh, const trace_lights& lights, int i, int j,
     const trace_params& params) {
   auto& camera  = scene.cameras[params.camera];
   auto  sampler = get_trace_sampler_func(params);
   auto  idx     = state.width * j + i;
-  auto  ray     = sample_camera(camera, {i, j}, {state.width, state.height},
-      rand2f(state.rngs[idx]), rand2f(state.rngs[idx]), params.tentfilter);
-  auto [radiance, hit, albedo, normal] = sampler(
-      scene, bvh, lights, ray, state.rngs[idx], params);
-  if (!isfinite(radiance)) radiance = {0, 0, 0};
-  if (max(radiance) > params.clamp)
-    radiance = radiance * (params.clamp / max(radiance));
-  if (hit) {
-    state.image[idx] += {radiance.x, radiance.y, radiance.z, 1};
-    state.albedo[idx] += albedo;
-    state.normal[idx] += normal;
-    state.hits[idx] += 1;
-  } else if (!params.envhidden && !scene.environments.empty()) {
-    state.image[idx] += {radiance.x, radiance.y, radiance.z, 1};
-    state.albedo[idx] += {1, 1, 1};
-    state.normal[idx] += -ray.d;
-    state.hits[idx] += 1;
+  auto  image   = vec4f{0, 0, 0, 0};
+  auto  albedo  = vec3f{0, 0, 0};
+  auto  normal  = vec3f{0, 0, 0};
+  auto  hits    = 0;
+  auto  batch   = trace_batch(state, params);
+  for (auto sample = 0; sample < batch; sample++) {
+    auto rng = make_counter_rng((uint32_t)params.seed, {i, j},
+        state.samples + sample, params.sequence);
+    auto ray = sample_camera(camera, {i, j}, {state.width, state.height},
+        rand2f(rng), rand2f(rng), params.tentfilter);
+    auto [radiance, hit, hit_albedo, hit_normal] = sampler(
+        scene, bvh, lights, ray, rng, params);
+    if (!isfinite(radiance)) radiance = {0, 0, 0};
+    if (max(radiance) > params.clamp)
+      radiance = radiance * (params.clamp / max(radiance));
+    if (hit) {
+      image += {radiance.x, radiance.y, radiance.z, 1};
+      albedo += hit_albedo;
+      normal += hit_normal;
+      hits += 1;
+    } else if (!params.envhidden && !scene.environments.empty()) {
+      image += {radiance.x, radiance.y, radiance.z, 1};
+      albedo += {1, 1, 1};
+      normal += -ray.d;
+      hits += 1;
+    }
   }
+  state.image[idx] += image;
+  state.albedo[idx] += albedo;
+  state.normal[idx] += normal;
+  state.hits[idx] += hits;
 }
 
 // Init a sequence of random number generators.
@@ -1364,11 +1383,6 @@ trace_state make_state(const scene_data& scene, const trace_params& params) {
   state.albedo.assign(state.width * state.height, {0, 0, 0});
   state.normal.assign(state.width * state.height, {0, 0, 0});
   state.hits.assign(state.width * state.height, 0);
-  state.rngs.assign(state.width * state.height, {});
-  auto rng_ = make_rng(1301081);
-  for (auto& rng : state.rngs) {
-    rng = make_rng(params.seed, rand1i(rng_, 1 << 31) / 2 + 1);
-  }
   return state;
 }
 
@@ -1459,7 +1473,7 @@ void trace_samples(trace_state& state, const scene_data& scene,
       trace_sample(state, scene, bvh, lights, i, j, params);
     });
   }
-  state.samples += 1;
+  state.samples += trace_batch(state, params);
 }
 
 // Check image type
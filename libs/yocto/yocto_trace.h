@@ -105,8 +105,10 @@ struct trace_params {
   bool                  envhidden      = false;
   bool                  tentfilter     = false;
   uint64_t              seed           = trace_default_seed;
+  sequence_type         sequence       = sequence_type::random;
   bool                  embreebvh      = false;
   bool                  highqualitybvh = false;
+  bool                  widebvh        = true;
   bool                  noparallel     = false;
   int                   pratio         = 8;
   float                 exposure       = 0;
@@ -149,7 +151,6 @@ struct trace_state {
   vector<vec3f>     albedo  = {};
   vector<vec3f>     normal  = {};
   vector<int>       hits    = {};
-  vector<rng_state> rngs    = {};
 };
 
 // Initialize state.
@@ -158,10 +159,19 @@ trace_state make_state(const scene_data& scene, const trace_params& params);
 // Initialize lights.
 trace_lights make_lights(const scene_data& scene, const trace_params& params);
 
+// Sample lights wrt solid angle from a position, returning a direction.
+vec3f sample_lights(const scene_data& scene, const trace_lights& lights,
+    const vec3f& position, float rl, float rel, const vec2f& ruv);
+// Pdf of sampling the lights from a position along a direction.
+float sample_lights_pdf(const scene_data& scene, const bvh_data& bvh,
+    const trace_lights& lights, const vec3f& position, const vec3f& direction);
+
 // Build the bvh acceleration structure.
 bvh_data make_bvh(const scene_data& scene, const trace_params& params);
 
-// Progressively computes an image.
+// Progressively computes an image, adding a batch of samples per pixel in
+// each call. trace_sample() adds the batch of a single pixel, numbering its
+// samples from `state.samples`, that callers advance once all pixels are done.
 void trace_samples(trace_state& state, const scene_data& scene,
     const bvh_data& bvh, const trace_lights& lights,
     const trace_params& params);
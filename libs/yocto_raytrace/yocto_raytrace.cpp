@@ -27,7 +27,12 @@
 //
 
 #include "yocto_raytrace.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
 #include <iostream>
+#include <limits>
 #include <yocto/yocto_cli.h>
 #include <yocto/yocto_geometry.h>
 #include <yocto/yocto_parallel.h>
@@ -59,32 +64,159 @@ static ray3f eval_camera(const camera_data& camera, const vec2f& uv) {
 // -----------------------------------------------------------------------------
 namespace yocto {
 
-vec3f shade_indirect(const scene_data& scene, ray3f ray, int bounce,
-    int max_bounces, const bvh_scene& bvh, rng_state& rng) {  
-  auto isec = intersect_bvh(bvh, scene, ray);
-  if (!isec.hit) return eval_environment(scene, ray.d);
+// Counter groups of the bvh queries of each kind of ray.
+const auto raytrace_camera_rays = 0;
+const auto raytrace_bounce_rays = 1;
+const auto raytrace_light_rays  = 2;
+
+// Bounces after which paths are stopped with russian roulette. This is
+// below the default bounce count, so that default renders use it too.
+const auto raytrace_roulette_bounces = 2;
+
+// Power heuristic for multiple importance sampling.
+static float mis_heuristic(float this_pdf, float other_pdf) {
+  return (this_pdf * this_pdf) / (this_pdf * this_pdf + other_pdf * other_pdf);
+}
+
+// Seed of the opacity filter of a ray, drawn from its random numbers.
+static uint64_t opacity_seed(counter_rng& rng) {
+  return (uint64_t)rand1i(rng, std::numeric_limits<int>::max());
+}
+
+// Opacity test of a hit. Hits on partially opaque surfaces are accepted
+// with a probability equal to their opacity, so that rays cross them
+// stochastically during traversal. Opaque materials are accepted without
+// evaluating them. The random numbers are drawn per element from a seed of
+// the ray, so that elements stored in more than one bvh leaf are accepted
+// or rejected once.
+static bool accept_opacity(const scene_data& scene, uint64_t seed,
+    int instance_id, int element, const vec2f& uv) {
+  auto& instance = scene.instances[instance_id];
+  auto& material = scene.materials[instance.material];
+  if (material.opacity >= 1 && material.color_tex == invalidid &&
+      scene.shapes[instance.shape].colors.empty())
+    return true;
+  auto opacity = eval_material(scene, instance, element, uv).opacity;
+  if (opacity >= 1) return true;
+  auto rng = make_rng(
+      seed, ((uint64_t)instance_id << 32) | (uint64_t)(uint32_t)element);
+  return rand1f(rng) < opacity;
+}
+
+// Opacity filter for the hits of a ray.
+static bvh_filter opacity_filter(const scene_data& scene, counter_rng& rng) {
+  auto seed = opacity_seed(rng);
+  return [&scene, seed](int instance, int element, const vec2f& uv) {
+    return accept_opacity(scene, seed, instance, element, uv);
+  };
+}
+
+// Opacity filter for the hits of a packet or stream of rays, given the
+// seeds of the rays. Each ray draws its seed as a single ray would, so that
+// packets and streams accept the same hits as rays traced one at a time.
+static bvh_stream_filter opacity_filter(
+    const scene_data& scene, const vector<uint64_t>& seeds) {
+  return [&scene, &seeds](int ray, int instance, int element,
+             const vec2f& uv) {
+    return accept_opacity(scene, seeds[ray], instance, element, uv);
+  };
+}
+
+// Direct lighting at a diffuse point. A light is sampled and the emission
+// seen along that direction is returned, weighted by the cosine and by MIS
+// against cosine hemisphere sampling. Partially opaque surfaces are crossed
+// stochastically as in the path, so both strategies see the same scene.
+static vec3f sample_direct(const scene_data& scene, const bvh_scene& bvh,
+    const raytrace_lights& lights, const vec3f& position, const vec3f& normal,
+    counter_rng& rng) {
+  auto incoming = sample_lights(
+      scene, lights, position, rand1f(rng), rand1f(rng), rand2f(rng));
+  auto cosine = dot(normal, incoming);
+  if (incoming == vec3f{0, 0, 0} || cosine <= 0) return {0, 0, 0};
+  set_bvh_counter_group(raytrace_light_rays);
+  auto light_pdf = sample_lights_pdf(scene, bvh, lights, position, incoming);
+  if (light_pdf <= 0) return {0, 0, 0};
+  auto bsdf_pdf = sample_hemisphere_cos_pdf(normal, incoming);
+
+  auto isec = intersect_bvh(
+      bvh, scene, ray3f{position, incoming}, opacity_filter(scene, rng));
+  auto emission = vec3f{0, 0, 0};
+  if (isec.hit) {
+    auto& instance = scene.instances[isec.instance];
+    emission = eval_material(scene, instance, isec.element, isec.uv).emission;
+  } else {
+    emission = eval_environment(scene, incoming);
+  }
+
+  return emission * (cosine / pif) * mis_heuristic(light_pdf, bsdf_pdf) /
+         light_pdf;
+}
+
+// State of a path traced by the raytrace shader. The MIS state is the one
+// of the last diffuse vertex, with zero pdf when emission should be taken
+// as is.
+struct raytrace_path {
+  ray3f ray          = {};
+  vec3f radiance     = {0, 0, 0};
+  vec3f weight       = {1, 1, 1};
+  float mis_pdf      = 0;
+  vec3f mis_position = {0, 0, 0};
+  int   bounce       = 0;
+};
+
+// Extend a path by one vertex, given the intersection of its ray, found with
+// the opacity filter, so that transparent hits are never seen. Emission
+// found at the vertex is added to the path radiance, and the path ray is set
+// to continue the path. Returns whether the path continues. Paths are
+// stopped with russian roulette after a few bounces. At diffuse vertices,
+// lights are sampled directly and emission found by the following bounce is
+// weighted with MIS against that light sample.
+static bool raytrace_step(const scene_data& scene, const bvh_scene& bvh,
+    const raytrace_lights& lights, raytrace_path& path,
+    const bvh_intersection& isec, counter_rng& rng,
+    const raytrace_params& params) {
+  // path state
+  auto& ray          = path.ray;
+  auto& radiance     = path.radiance;
+  auto& weight       = path.weight;
+  auto& mis_pdf      = path.mis_pdf;
+  auto& mis_position = path.mis_position;
+  auto  bounce       = path.bounce;
+  auto  lit          = !params.nolights && !lights.lights.empty();
+
+  if (!isec.hit) {
+    auto emission = eval_environment(scene, ray.d);
+    if (mis_pdf > 0 && emission != vec3f{0, 0, 0}) {
+      emission *= mis_heuristic(mis_pdf,
+          sample_lights_pdf(scene, bvh, lights, mis_position, ray.d));
+    }
+    radiance += weight * emission;
+    return false;
+  }
 
   const auto& instance = scene.instances[isec.instance];
   const auto& shape    = scene.shapes[instance.shape];
-  auto outgoing = -ray.d;
+  auto        outgoing = -ray.d;
 
   //position,normal texcoord
-  auto&  position = transform_point(instance.frame,eval_position(shape, isec.element, isec.uv));
-  auto& normal = transform_direction(instance.frame, eval_normal(shape, isec.element, isec.uv));
-  auto& texcoord = eval_texcoord(shape, isec.element, isec.uv);
+  auto position = transform_point(
+      instance.frame, eval_position(shape, isec.element, isec.uv));
+  auto normal = transform_direction(
+      instance.frame, eval_normal(shape, isec.element, isec.uv));
 
   //material values
-  auto& material = eval_material(scene,instance,isec.element,isec.uv);
-  auto& color = material.color;
-
-  // opacity
-  if (rand1f(rng) < 1 - material.opacity)
-    return shade_indirect(scene, ray3f{position, ray.d}, bounce + 1, max_bounces, bvh, rng);
+  auto  material = eval_material(scene, instance, isec.element, isec.uv);
+  auto& color    = material.color;
 
   //radiance
-  auto radiance = material.emission;
+  auto emission = material.emission;
+  if (mis_pdf > 0 && emission != vec3f{0, 0, 0}) {
+    emission *= mis_heuristic(mis_pdf,
+        sample_lights_pdf(scene, bvh, lights, mis_position, ray.d));
+  }
+  radiance += weight * emission;
 
-  if (bounce >= max_bounces) return radiance;
+  if (bounce >= params.bounces) return false;
 
   if (!shape.points.empty()) {
     normal = -ray.d;
@@ -95,126 +227,168 @@ vec3f shade_indirect(const scene_data& scene, ray3f ray, int bounce,
       normal = -normal;
     }
   }
+
+  // next direction, with emission reached past non-diffuse vertices taken
+  // as is, since light samples see no emission through them
+  mis_pdf = 0;
   switch (material.type) {
     case material_type::matte: {
+      if (lit) {
+        radiance += weight * color *
+                    sample_direct(scene, bvh, lights, position, normal, rng);
+      }
       auto incoming = sample_hemisphere_cos(normal, rand2f(rng));
-      radiance += color * shade_indirect(scene,
-                                       ray3f{position, incoming}, bounce + 1,
-                                       max_bounces, bvh, rng);
+      weight *= color;
+      ray = {position, incoming};
+      if (lit) {
+        mis_pdf      = sample_hemisphere_cos_pdf(normal, incoming);
+        mis_position = position;
+      }
       break;
     }
-   
+
     case material_type::reflective: {
-      if (!material.roughness) {//polished metal
+      if (!material.roughness) {  //polished metal
         auto incoming = reflect(outgoing, normal);
-        radiance += fresnel_schlick(color, normal, outgoing) *
-                    shade_indirect(scene, ray3f{position, incoming},
-                        bounce + 1, max_bounces, bvh, rng);
-      } 
-      else {//rough metal
+        weight *= fresnel_schlick(color, normal, outgoing);
+        ray = {position, incoming};
+      } else {  //rough metal
         float exponent = 2 / (material.roughness * material.roughness);
-        auto halfway = sample_hemisphere_cospower(exponent,normal, rand2f(rng));
+        auto  halfway  = sample_hemisphere_cospower(
+            exponent, normal, rand2f(rng));
         auto incoming = reflect(outgoing, halfway);
-        radiance += color*shade_indirect(scene, ray3f{position, incoming}, bounce + 1, max_bounces, bvh, rng);
-      };
+        weight *= color;
+        ray = {position, incoming};
+      }
       break;
     }
-   
-    case material_type::glossy: { //rough plastic
+
+    case material_type::glossy: {  //rough plastic
       float exponent = 2 / (material.roughness * material.roughness);
-      auto  halfway = sample_hemisphere_cospower(exponent, normal, rand2f(rng));
+      auto halfway = sample_hemisphere_cospower(exponent, normal, rand2f(rng));
       if (rand1f(rng) < fresnel_schlick(vec3f{0.04}, halfway, outgoing).x) {
-        auto& incoming = reflect(outgoing, halfway);
-        radiance += shade_indirect(scene, ray3f{position, incoming}, bounce + 1,
-            max_bounces, bvh, rng);
+        auto incoming = reflect(outgoing, halfway);
+        ray           = {position, incoming};
       } else {
-        auto& incoming = sample_hemisphere_cos(normal, rand2f(rng));
-        radiance += color * shade_indirect(scene, ray3f{position, incoming},
-                                bounce + 1, max_bounces, bvh, rng);
+        if (lit) {
+          radiance += weight * color *
+                      sample_direct(scene, bvh, lights, position, normal, rng);
+        }
+        auto incoming = sample_hemisphere_cos(normal, rand2f(rng));
+        weight *= color;
+        ray = {position, incoming};
+        if (lit) {
+          mis_pdf      = sample_hemisphere_cos_pdf(normal, incoming);
+          mis_position = position;
+        }
       }
       break;
     }
-    case material_type::transparent : { //polished dielectrics
-      if (rand1f(rng) <fresnel_schlick(vec3f{0.04}, normal, outgoing).x) {
-        auto& incoming = reflect(outgoing, normal);
-        radiance += shade_indirect(scene, ray3f{position, incoming}, bounce + 1,max_bounces,  bvh,  rng);
+    case material_type::transparent: {  //polished dielectrics
+      if (rand1f(rng) < fresnel_schlick(vec3f{0.04}, normal, outgoing).x) {
+        auto incoming = reflect(outgoing, normal);
+        ray           = {position, incoming};
       } else {
-        auto& incoming = -outgoing;
-        radiance += color * shade_indirect(scene,ray3f{position, incoming}, bounce + 1, max_bounces, bvh, rng);
+        auto incoming = -outgoing;
+        weight *= color;
+        ray = {position, incoming};
       }
       break;
     }
     case material_type::refractive: {
-      auto ior         = material.ior;
+      auto  ior = material.ior;
       float refraction_ratio;
-     
-      if (dot(-ray.d, normal) <= 0) {// il raggio sta uscendo  (-)
+
+      if (dot(-ray.d, normal) <= 0) {  // il raggio sta uscendo  (-)
         normal           = -normal;
-        refraction_ratio =ior;
-      } 
-      else {//il raggio sta entrando nell'oggetto  (-)
+        refraction_ratio = ior;
+      } else {  //il raggio sta entrando nell'oggetto  (-)
         refraction_ratio = (1.0 / ior);
       }
       vec3f unit_direction = -ray.d;
-  
 
-      double cos_theta = fmin(dot(-unit_direction, normal), 1.0);
-      double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
-      bool  cannot_refract = refraction_ratio * sin_theta > 1.0;
-     
+      double cos_theta      = fmin(dot(-unit_direction, normal), 1.0);
+      double sin_theta      = sqrt(1.0 - cos_theta * cos_theta);
+      bool   cannot_refract = refraction_ratio * sin_theta > 1.0;
 
       vec3f direction;
       //se non posso rifrangere, rifletto
-      if (cannot_refract || rand1f(rng) > fresnel_schlick(vec3f{refraction_ratio}, normal, outgoing).x) 
+      if (cannot_refract ||
+          rand1f(rng) >
+              fresnel_schlick(vec3f{refraction_ratio}, normal, outgoing).x)
         direction = reflect(unit_direction, normal);
-      else 
+      else
         direction = refract(unit_direction, normal, refraction_ratio);
-    
-      radiance += color * shade_indirect(scene, ray3f{position, direction},
-                              bounce + 1, max_bounces, bvh, rng);
-        break;
+
+      weight *= color;
+      ray = {position, direction};
+      break;
     }
     case material_type::volumetric: {
-      
       //creo un raggio che va sull'altra facciata (se c'e')
-      auto isec2       = intersect_bvh(bvh, scene, isec.instance, ray3f{position, ray.d});
+      auto isec2 = intersect_bvh(
+          bvh, scene, isec.instance, ray3f{position, ray.d});
 
       float max_distance = isec.distance;
-      vec3f position2 = position;
+      vec3f position2    = position;
       if (isec2.hit) {  // se ho colpito , setto la seconda posizione e la distanza percorsa dal raggio dal punto1 al punto2
-        position2 = transform_point(instance.frame, eval_position(shape, isec2.element, isec2.uv));
-        max_distance = distance(position2, position);  
-      } 
-      material.density = {0.99,0.99,0.99};
+        position2    = transform_point(instance.frame,
+            eval_position(shape, isec2.element, isec2.uv));
+        max_distance = distance(position2, position);
+      }
+      material.density = {0.99, 0.99, 0.99};
 
       // distanza proprorzionale alla trasmittanza, se == max distance allora vuol dire molto trasmittente e attraversa senza scatterare
-      auto distance = sample_transmittance( material.density, max_distance, rand1f(rng), rand1f(rng));
-  
-      if (distance <max_distance) {
+      auto distance = sample_transmittance(
+          material.density, max_distance, rand1f(rng), rand1f(rng));
+
+      if (distance < max_distance) {
         vec3f scatter_point = position + distance * ray.d;  //punto all'interno dell'istanza in cui scattero
-        auto direction = sample_sphere( rand2f(rng));//direzione in cui scatterare
-        radiance +=  color * shade_indirect(scene, ray3f{scatter_point, direction}, bounce + 1,max_bounces, bvh, rng);
-      } 
-      else {//attraverso
-        radiance += shade_indirect(scene, ray3f{position, ray.d}, bounce + 1,
-                max_bounces, bvh, rng);
+        auto direction = sample_sphere(rand2f(rng));  //direzione in cui scatterare
+        weight *= color;
+        ray = {scatter_point, direction};
+      } else {  //attraverso
+        ray = {position, ray.d};
       }
       break;
     }
   }
-  return radiance;
+
+  // check weight
+  if (weight == vec3f{0, 0, 0} || !isfinite(weight)) return false;
+
+  // russian roulette
+  if (bounce >= raytrace_roulette_bounces) {
+    auto rr_prob = min((float)0.99, max(weight));
+    if (rand1f(rng) >= rr_prob) return false;
+    weight *= 1 / rr_prob;
+  }
+
+  path.bounce += 1;
+  return true;
 }
-  // Raytrace renderer.
+
+// Raytrace renderer. Paths are traced iteratively, one vertex at a time.
+// The camera hit is found with the opacity filter, like the later ones.
 static vec4f shade_raytrace(const scene_data& scene, const bvh_scene& bvh,
-    const ray3f& ray, int bounce, rng_state& rng,
+    const raytrace_lights& lights, const ray3f& ray,
+    const bvh_intersection& isec_, int bounce, counter_rng& rng,
     const raytrace_params& params) {
-  return rgb_to_rgba(
-      shade_indirect(scene, ray, bounce, params.bounces, bvh, rng));
+  auto path   = raytrace_path{};
+  path.ray    = ray;
+  path.bounce = bounce;
+  auto isec   = isec_;
+  while (raytrace_step(scene, bvh, lights, path, isec, rng, params)) {
+    set_bvh_counter_group(raytrace_bounce_rays);
+    isec = intersect_bvh(bvh, scene, path.ray, opacity_filter(scene, rng));
+  }
+  return rgb_to_rgba(path.radiance);
 }
 
 // Matte renderer.
 static vec4f shade_matte(const scene_data& scene, const bvh_scene& bvh,
-    const ray3f& ray, int bounce, rng_state& rng,
+    const raytrace_lights& lights, const ray3f& ray,
+    const bvh_intersection& isec, int bounce, counter_rng& rng,
     const raytrace_params& params) {
   // YOUR CODE GOES HERE ----
   return {0, 0, 0, 0};
@@ -222,10 +396,10 @@ static vec4f shade_matte(const scene_data& scene, const bvh_scene& bvh,
 
 // Eyelight renderer.
 static vec4f shade_eyelight(const scene_data& scene, const bvh_scene& bvh,
-    const ray3f& ray, int bounce, rng_state& rng,
+    const raytrace_lights& lights, const ray3f& ray,
+    const bvh_intersection& isec, int bounce, counter_rng& rng,
     const raytrace_params& params) {
 
-  auto isec = intersect_bvh(bvh,scene, ray);
   if (!isec.hit) return {0, 0, 0};
 
   auto& instance = scene.instances[isec.instance];
@@ -238,9 +412,9 @@ static vec4f shade_eyelight(const scene_data& scene, const bvh_scene& bvh,
 }
 
 static vec4f shade_normal(const scene_data& scene, const bvh_scene& bvh,
-    const ray3f& ray, int bounce, rng_state& rng,
+    const raytrace_lights& lights, const ray3f& ray,
+    const bvh_intersection& isec, int bounce, counter_rng& rng,
     const raytrace_params& params) {
-  auto isec = intersect_bvh(bvh,scene, ray);
   if (!isec.hit) return {0, 0, 0};
   auto& instance = scene.instances[isec.instance];
   auto& shape    = scene.shapes[instance.shape];
@@ -251,9 +425,9 @@ static vec4f shade_normal(const scene_data& scene, const bvh_scene& bvh,
 }
 
 static vec4f shade_texcoord(const scene_data& scene, const bvh_scene& bvh,
-    const ray3f& ray, int bounce, rng_state& rng,
+    const raytrace_lights& lights, const ray3f& ray,
+    const bvh_intersection& isec, int bounce, counter_rng& rng,
     const raytrace_params& params) {
-  auto isec = intersect_bvh(bvh, scene, ray);
   if (!isec.hit) return {0, 0, 0};
   auto& instance = scene.instances[isec.instance];
   auto& shape    = scene.shapes[instance.shape];
@@ -262,33 +436,33 @@ static vec4f shade_texcoord(const scene_data& scene, const bvh_scene& bvh,
 }
 
 static vec4f shade_color(const scene_data& scene, const bvh_scene& bvh,
-    const ray3f& ray, int bounce, rng_state& rng,
+    const raytrace_lights& lights, const ray3f& ray,
+    const bvh_intersection& isec, int bounce, counter_rng& rng,
     const raytrace_params& params) {
-  auto intersection = intersect_bvh(bvh, scene, ray);
-  if (!intersection.hit) return {0, 0, 0};
-  auto& material     = scene.materials[intersection.instance];
+  if (!isec.hit) return {0, 0, 0};
+  auto& material     = scene.materials[isec.instance];
   auto color        = material.color;
   return {color.x, color.y, color.z, 1.0};
 }
 
 static vec4f shade_matcap(const scene_data& scene, const bvh_scene& bvh,
-    const ray3f& ray, int bounce, rng_state& rng,
+    const raytrace_lights& lights, const ray3f& ray,
+    const bvh_intersection& isec, int bounce, counter_rng& rng,
     const raytrace_params& params) {
 
 
-  auto isec = intersect_bvh(bvh, scene, ray);
   if (!isec.hit) return {0, 0, 0};
 
   auto& instance    = scene.instances[isec.instance];
   if (isec.element  == 0) {//per non distorcere  il mio pavimento
-    auto& material = eval_material(scene, instance, isec.element, isec.uv);
+    auto material = eval_material(scene, instance, isec.element, isec.uv);
     return vec4f{material.color.x, material.color.y, material.color.z, 1};
   }
 
 
   auto& shape       = scene.shapes[instance.shape];
   auto  normal      = transform_direction(instance.frame, eval_normal(shape, isec.element, isec.uv));
-  //auto& material = eval_material(scene, instance, isec.element, isec.uv);
+  //auto material = eval_material(scene, instance, isec.element, isec.uv);
   auto& material = scene.materials[isec.instance];
   auto& texture  = scene.textures[material.color_tex];
 
@@ -306,8 +480,11 @@ static vec4f shade_matcap(const scene_data& scene, const bvh_scene& bvh,
 }
 
 // Trace a single ray from the camera using the given algorithm.
+// Shaders are given the first intersection of the ray, so that camera rays
+// can be traced in packets.
 using raytrace_shader_func = vec4f (*)(const scene_data& scene,
-    const bvh_scene& bvh, const ray3f& ray, int bounce, rng_state& rng,
+    const bvh_scene& bvh, const raytrace_lights& lights, const ray3f& ray,
+    const bvh_intersection& isec, int bounce, counter_rng& rng,
     const raytrace_params& params);
 static raytrace_shader_func get_shader(const raytrace_params& params) {
   switch (params.shader) {
@@ -327,7 +504,18 @@ static raytrace_shader_func get_shader(const raytrace_params& params) {
 
 // Build the bvh acceleration structure.
 bvh_scene make_bvh(const scene_data& scene, const raytrace_params& params) {
-  return make_bvh(scene, false, false, params.noparallel);
+  return make_bvh(scene, bvh_params{params.highqualitybvh, false,
+                             params.noparallel, params.widebvh,
+                             params.trianglesbvh, params.linearbvh,
+                             params.spatialbvh, params.lazybvh,
+                             params.bvhcache});
+}
+
+// Initialize lights.
+raytrace_lights make_lights(
+    const scene_data& scene, const raytrace_params& params) {
+  if (params.nolights) return {};
+  return make_lights(scene, trace_params{});
 }
 
 // Init a sequence of random number generators.
@@ -345,53 +533,378 @@ raytrace_state make_state(
   state.samples = 0;
   state.image.assign(state.width * state.height, {0, 0, 0, 0});
   state.hits.assign(state.width * state.height, 0);
-  state.rngs.assign(state.width * state.height, {});
-  auto rng_ = make_rng(1301081);
-  for (auto& rng : state.rngs) {
-    rng = make_rng(961748941ull, rand1i(rng_, 1 << 31) / 2 + 1);
-  }
+  state.moments.assign(state.width * state.height, 0);
+  if (bvh_counting) state.costs.assign(state.width * state.height, 0);
   return state;
 }
 
+// Split the image into tiles of `size` pixels per side. Tiles are sorted
+// along a Morton curve, so that consecutive tiles are close on screen.
+static vector<vec4i> make_tiles(int width, int height, int size) {
+  auto interleave = [](uint32_t x) {
+    x = (x | (x << 8)) & 0x00ff00ffu;
+    x = (x | (x << 4)) & 0x0f0f0f0fu;
+    x = (x | (x << 2)) & 0x33333333u;
+    x = (x | (x << 1)) & 0x55555555u;
+    return x;
+  };
+  size        = max(size, 1);
+  auto ntiles = vec2i{(width + size - 1) / size, (height + size - 1) / size};
+  auto codes  = vector<pair<uint32_t, vec4i>>{};
+  codes.reserve(ntiles.x * ntiles.y);
+  for (auto tj = 0; tj < ntiles.y; tj++) {
+    for (auto ti = 0; ti < ntiles.x; ti++) {
+      auto code = interleave(ti) | (interleave(tj) << 1);
+      codes.push_back({code, {ti * size, tj * size, min((ti + 1) * size, width),
+                                 min((tj + 1) * size, height)}});
+    }
+  }
+  std::sort(codes.begin(), codes.end(),
+      [](auto& a, auto& b) { return a.first < b.first; });
+  auto tiles = vector<vec4i>(codes.size());
+  for (auto idx = 0; idx < (int)codes.size(); idx++) {
+    tiles[idx] = codes[idx].second;
+  }
+  return tiles;
+}
+
+// Random numbers of a sample of pixel i, j. Samples are numbered by pixel,
+// so that each one is the same however passes and tiles are split.
+static counter_rng make_sample_rng(const raytrace_state& state, int i, int j,
+    int sample, const raytrace_params& params) {
+  return make_counter_rng(params.seed, {i, j}, sample, params.sequence);
+}
+
+// Camera ray of a sample for pixel i, j. A single sample is taken at the
+// pixel center, while progressive samples are jittered.
+static ray3f sample_camera_ray(const raytrace_state& state,
+    const scene_data& scene, int i, int j, counter_rng& rng,
+    const raytrace_params& params) {
+  auto& camera = scene.cameras[params.camera];
+  auto  puv    = params.samples == 1 ? vec2f{0.5f, 0.5f} : rand2f(rng);
+  auto  uv     = vec2f{(i + puv.x) / state.width, (j + puv.y) / state.height};
+  return eval_camera(camera, uv);
+}
+
+// Samples of a pixel, summed locally before they are added to the state, so
+// that a batch of samples writes to the image once.
+struct raytrace_pixel_sum {
+  vec4f radiance = {0, 0, 0, 0};
+  int   hits     = 0;
+  float moments  = 0;
+};
+
+// Add a sample to a pixel sum.
+static void add_sample(raytrace_pixel_sum& sum, vec4f radiance) {
+  if (!isfinite(radiance)) radiance = {0, 0, 0};
+  sum.radiance += radiance;
+  sum.hits += 1;
+  sum.moments += luminance(xyz(radiance)) * luminance(xyz(radiance));
+}
+
+// Add the samples of a pixel sum to a pixel.
+static void add_samples(
+    raytrace_state& state, int idx, const raytrace_pixel_sum& sum) {
+  state.image[idx] += sum.radiance;
+  state.hits[idx] += sum.hits;
+  state.moments[idx] += sum.moments;
+}
+
+// Traversal cost of the bvh queries of the calling thread so far, as the
+// nodes, instances and primitives they visited.
+static uint64_t traversal_cost() {
+  auto cost = (uint64_t)0;
+  for (auto& counters : get_bvh_thread_counters()) {
+    cost += counters.nodes + counters.instances + counters.primitives;
+  }
+  return cost;
+}
+
+// Add the traversal cost since `start` to a set of pixels, sharing it evenly.
+static void add_cost(
+    raytrace_state& state, const int* pixels, int count, uint64_t start) {
+  if (!bvh_counting || count == 0) return;
+  auto cost = (float)(traversal_cost() - start) / count;
+  for (auto idx = 0; idx < count; idx++) state.costs[pixels[idx]] += cost;
+}
+
+// Shade a camera ray for pixel i, j, given its first intersection.
+static vec4f raytrace_sample(raytrace_state& state, const scene_data& scene,
+    const bvh_scene& bvh, const raytrace_lights& lights, int i, int j,
+    const ray3f& ray, const bvh_intersection& isec, counter_rng& rng,
+    const raytrace_params& params) {
+  auto shader = get_shader(params);
+  auto idx    = state.width * j + i;
+  auto cost   = bvh_counting ? traversal_cost() : 0;
+  set_bvh_counter_group(raytrace_camera_rays);
+  auto radiance = shader(scene, bvh, lights, ray, isec, 0, rng, params);
+  add_cost(state, &idx, 1, cost);
+  return radiance;
+}
+
+// Trace a batch of samples for pixel i, j.
+static void raytrace_pixel(raytrace_state& state, const scene_data& scene,
+    const bvh_scene& bvh, const raytrace_lights& lights, int i, int j,
+    int samples, const raytrace_params& params) {
+  auto idx = state.width * j + i;
+  auto sum = raytrace_pixel_sum{};
+  for (auto sample = 0; sample < samples; sample++) {
+    auto rng  = make_sample_rng(state, i, j, state.hits[idx] + sample, params);
+    auto ray  = sample_camera_ray(state, scene, i, j, rng, params);
+    auto cost = bvh_counting ? traversal_cost() : 0;
+    set_bvh_counter_group(raytrace_camera_rays);
+    auto isec = params.shader == raytrace_shader_type::raytrace
+                    ? intersect_bvh(bvh, scene, ray, opacity_filter(scene, rng))
+                    : intersect_bvh(bvh, scene, ray);
+    add_cost(state, &idx, 1, cost);
+    add_sample(sum, raytrace_sample(state, scene, bvh, lights, i, j, ray,
+                        isec, rng, params));
+  }
+  add_samples(state, idx, sum);
+}
+
+// Size of the pixel blocks whose camera rays are traced as a packet.
+const auto raytrace_packet_block = 4;
+
+// Trace a batch of samples for each pixel of a block, tracing camera rays as
+// packets. Partial blocks repeat their last ray to fill the packet. Camera
+// hits are filtered by opacity during traversal for the raytrace shader.
+static void raytrace_block(raytrace_state& state, const scene_data& scene,
+    const bvh_scene& bvh, const raytrace_lights& lights, const vec4i& block,
+    int samples, const raytrace_params& params) {
+  const auto size    = raytrace_packet_block * raytrace_packet_block;
+  auto       rays    = array<ray3f, size>{};
+  auto       pixels  = array<vec2i, size>{};
+  auto       indices = array<int, size>{};
+  auto       rngs    = array<counter_rng, size>{};
+  auto       sums    = array<raytrace_pixel_sum, size>{};
+  auto       seeds   = vector<uint64_t>(size, 0);
+  auto       opacity = params.shader == raytrace_shader_type::raytrace;
+  auto       count   = 0;
+  for (auto j = block.y; j < block.w; j++) {
+    for (auto i = block.x; i < block.z; i++) {
+      pixels[count]    = {i, j};
+      indices[count++] = state.width * j + i;
+    }
+  }
+  for (auto sample = 0; sample < samples; sample++) {
+    for (auto idx = 0; idx < count; idx++) {
+      auto [i, j] = pixels[idx];
+      rngs[idx]   = make_sample_rng(
+          state, i, j, state.hits[indices[idx]] + sample, params);
+      rays[idx] = sample_camera_ray(state, scene, i, j, rngs[idx], params);
+      if (opacity) seeds[idx] = opacity_seed(rngs[idx]);
+    }
+    for (auto idx = count; idx < size; idx++) {
+      rays[idx]  = rays[count - 1];
+      seeds[idx] = seeds[count - 1];
+    }
+    auto cost = bvh_counting ? traversal_cost() : 0;
+    set_bvh_counter_group(raytrace_camera_rays);
+    auto isecs = opacity ? intersect_bvh(
+                               bvh, scene, rays, opacity_filter(scene, seeds))
+                         : intersect_bvh(bvh, scene, rays);
+    add_cost(state, indices.data(), count, cost);
+    for (auto idx = 0; idx < count; idx++) {
+      add_sample(sums[idx],
+          raytrace_sample(state, scene, bvh, lights, pixels[idx].x,
+              pixels[idx].y, rays[idx], isecs[idx], rngs[idx], params));
+    }
+  }
+  for (auto idx = 0; idx < count; idx++) {
+    add_samples(state, indices[idx], sums[idx]);
+  }
+}
+
+// Trace the samples of a tile with the raytrace shader as a wavefront. All
+// the paths of the tile advance together, one vertex at a time: their rays
+// are intersected as a stream, filtered by opacity during traversal with a
+// seed per ray, then hits are shaded sorted by material, so that paths
+// running the same material code and textures are shaded together. Path
+// rays, intersections, states, random numbers and pixels are kept in
+// separate arrays. Finished paths are summed per pixel and removed, and the
+// sums are added to the image once the tile is done.
+static void raytrace_wavefront(raytrace_state& state, const scene_data& scene,
+    const bvh_scene& bvh, const raytrace_lights& lights, const vec4i& tile,
+    int pixel_samples, const raytrace_params& params) {
+  // generate camera paths, with pixels indexed within the tile
+  auto width       = tile.z - tile.x;
+  auto paths       = vector<raytrace_path>{};
+  auto rngs        = vector<counter_rng>{};
+  auto pixels      = vector<int>{};
+  auto sums        = vector<raytrace_pixel_sum>(width * (tile.w - tile.y));
+  auto tile_pixels = vector<int>{};
+  for (auto j = tile.y; j < tile.w; j++) {
+    for (auto i = tile.x; i < tile.z; i++) {
+      auto idx = state.width * j + i;
+      for (auto sample = 0; sample < pixel_samples; sample++) {
+        auto rng = make_sample_rng(
+            state, i, j, state.hits[idx] + sample, params);
+        auto path = raytrace_path{};
+        path.ray  = sample_camera_ray(state, scene, i, j, rng, params);
+        paths.push_back(path);
+        rngs.push_back(rng);
+        pixels.push_back(width * (j - tile.y) + (i - tile.x));
+        if (bvh_counting) tile_pixels.push_back(idx);
+      }
+    }
+  }
+
+  // advance paths until all are done, sharing their cost over the tile
+  auto cost          = bvh_counting ? traversal_cost() : 0;
+  auto camera        = true;
+  auto rays          = vector<ray3f>{};
+  auto seeds         = vector<uint64_t>{};
+  auto intersections = vector<bvh_intersection>{};
+  auto order         = vector<pair<int, int>>{};
+  auto alive         = vector<bool>{};
+  while (!paths.empty()) {
+    // extend paths
+    rays.resize(paths.size());
+    seeds.resize(paths.size());
+    for (auto idx = 0; idx < (int)paths.size(); idx++) {
+      rays[idx]  = paths[idx].ray;
+      seeds[idx] = opacity_seed(rngs[idx]);
+    }
+    set_bvh_counter_group(
+        camera ? raytrace_camera_rays : raytrace_bounce_rays);
+    intersect_bvh(
+        bvh, scene, rays, intersections, opacity_filter(scene, seeds));
+
+    // sort hits by material, with misses first
+    order.resize(paths.size());
+    for (auto idx = 0; idx < (int)paths.size(); idx++) {
+      auto& isec = intersections[idx];
+      order[idx] = {
+          isec.hit ? scene.instances[isec.instance].material + 1 : 0, idx};
+    }
+    std::sort(order.begin(), order.end());
+
+    // shade hits, adding finished paths to their pixels
+    alive.assign(paths.size(), false);
+    for (auto& [material, idx] : order) {
+      alive[idx] = raytrace_step(scene, bvh, lights, paths[idx],
+          intersections[idx], rngs[idx], params);
+      if (!alive[idx]) {
+        add_sample(sums[pixels[idx]], rgb_to_rgba(paths[idx].radiance));
+      }
+    }
+
+    // remove finished paths
+    auto count = 0;
+    for (auto idx = 0; idx < (int)paths.size(); idx++) {
+      if (!alive[idx]) continue;
+      paths[count]    = paths[idx];
+      rngs[count]     = rngs[idx];
+      pixels[count++] = pixels[idx];
+    }
+    paths.resize(count);
+    rngs.resize(count);
+    pixels.resize(count);
+    camera = false;
+  }
+  add_cost(state, tile_pixels.data(), (int)tile_pixels.size(), cost);
+
+  // add the tile samples to the image
+  for (auto pixel = 0; pixel < (int)sums.size(); pixel++) {
+    add_samples(state,
+        state.width * (tile.y + pixel / width) + tile.x + pixel % width,
+        sums[pixel]);
+  }
+}
+
+// Minimum number of samples before a pixel error is trusted.
+const auto raytrace_adaptive_samples = 16;
+
+// Estimated relative error of a pixel, computed as the standard error of the
+// mean luminance over the mean itself. Dark pixels are measured against a
+// small floor, to avoid spending samples on noise that is not visible.
+static float pixel_error(const raytrace_state& state, int idx) {
+  auto hits = state.hits[idx];
+  if (hits < 2) return flt_max;
+  auto mean     = luminance(xyz(state.image[idx])) / hits;
+  auto variance = max(state.moments[idx] / hits - mean * mean, 0.0f) * hits /
+                  (hits - 1);
+  return sqrt(variance / hits) / max(mean, 0.01f);
+}
+
+// Check whether a tile needs more samples in adaptive rendering. Errors are
+// pooled over the tile, since single pixels often underestimate their
+// variance and would stop too early.
+static bool is_tile_active(
+    const raytrace_state& state, const vec4i& tile, const raytrace_params& params) {
+  if (!params.adaptive) return true;
+  auto error = 0.0f, count = 0.0f;
+  for (auto j = tile.y; j < tile.w; j++) {
+    for (auto i = tile.x; i < tile.z; i++) {
+      auto idx = state.width * j + i;
+      if (state.hits[idx] < raytrace_adaptive_samples) return true;
+      error += pixel_error(state, idx) * pixel_error(state, idx);
+      count += 1;
+    }
+  }
+  return sqrt(error / count) > params.threshold;
+}
+
 // Progressively compute an image by calling trace_samples multiple times.
+// Each call adds a batch of samples per pixel in a single dispatch, and
+// pixels sum their batch locally before writing it to the image. Threads
+// grab whole tiles, so that nearby pixels are rendered together. In adaptive
+// mode, converged tiles are skipped and each pass spreads its budget of a
+// batch of samples per pixel over the tiles that are still noisy.
 void raytrace_samples(raytrace_state& state, const scene_data& scene,
     const bvh_scene& bvh, const raytrace_params& params) {
+  static const auto no_lights = raytrace_lights{};
+  raytrace_samples(state, scene, bvh, no_lights, params);
+}
+void raytrace_samples(raytrace_state& state, const scene_data& scene,
+    const bvh_scene& bvh, const raytrace_lights& lights,
+    const raytrace_params& params) {
   if (state.samples >= params.samples) return;
-  auto& camera = scene.cameras[params.camera];
-  auto  shader = get_shader(params);
-  state.samples += 1;
-  if (params.samples == 1) {
-    for (auto idx = 0; idx < state.width * state.height; idx++) {
-      auto i = idx % state.width, j = idx / state.width;
-      auto u = (i + 0.5f) / state.width, v = (j + 0.5f) / state.height;
-      auto ray      = eval_camera(camera, {u, v});
-      auto radiance = shader(scene, bvh, ray, 0, state.rngs[idx], params);
-      if (!isfinite(radiance)) radiance = {0, 0, 0};
-      state.image[idx] += radiance;
-      state.hits[idx] += 1;
+  auto batch         = clamp(params.batch, 1, params.samples - state.samples);
+  auto tiles         = make_tiles(state.width, state.height, params.tile);
+  auto pixel_samples = batch;
+  if (params.adaptive) {
+    auto active_tiles = vector<vec4i>{};
+    auto active       = 0;
+    for (auto& tile : tiles) {
+      if (!is_tile_active(state, tile, params)) continue;
+      active_tiles.push_back(tile);
+      active += (tile.z - tile.x) * (tile.w - tile.y);
     }
-  } else if (params.noparallel) {
-    for (auto idx = 0; idx < state.width * state.height; idx++) {
-      auto i = idx % state.width, j = idx / state.width;
-      auto u        = (i + rand1f(state.rngs[idx])) / state.width,
-           v        = (j + rand1f(state.rngs[idx])) / state.height;
-      auto ray      = eval_camera(camera, {u, v});
-      auto radiance = shader(scene, bvh, ray, 0, state.rngs[idx], params);
-      if (!isfinite(radiance)) radiance = {0, 0, 0};
-      state.image[idx] += radiance;
-      state.hits[idx] += 1;
+    if (active == 0) {
+      state.samples = params.samples;
+      return;
+    }
+    tiles         = active_tiles;
+    pixel_samples = batch * clamp(state.width * state.height / active, 1, 16);
+  }
+  state.samples += batch;
+  auto render_tile = [&](const vec4i& tile) {
+    if (params.wavefront && params.shader == raytrace_shader_type::raytrace) {
+      raytrace_wavefront(state, scene, bvh, lights, tile, pixel_samples, params);
+    } else if (params.packets) {
+      auto step = raytrace_packet_block;
+      for (auto j = tile.y; j < tile.w; j += step) {
+        for (auto i = tile.x; i < tile.z; i += step) {
+          auto block = vec4i{i, j, min(i + step, tile.z), min(j + step, tile.w)};
+          raytrace_block(
+              state, scene, bvh, lights, block, pixel_samples, params);
+        }
+      }
+    } else {
+      for (auto j = tile.y; j < tile.w; j++) {
+        for (auto i = tile.x; i < tile.z; i++) {
+          raytrace_pixel(
+              state, scene, bvh, lights, i, j, pixel_samples, params);
+        }
+      }
     }
+  };
+  if (params.noparallel) {
+    for (auto& tile : tiles) render_tile(tile);
   } else {
-    parallel_for(state.width * state.height, [&](int idx) {
-      auto i = idx % state.width, j = idx / state.width;
-      auto u        = (i + rand1f(state.rngs[idx])) / state.width,
-           v        = (j + rand1f(state.rngs[idx])) / state.height;
-      auto ray      = eval_camera(camera, {u, v});
-      auto radiance = shader(scene, bvh, ray, 0, state.rngs[idx], params);
-      if (!isfinite(radiance)) radiance = {0, 0, 0};
-      state.image[idx] += radiance;
-      state.hits[idx] += 1;
-    });
+    parallel_for(tiles.size(), [&](size_t idx) { render_tile(tiles[idx]); });
   }
 }
 
@@ -413,10 +926,336 @@ color_image get_render(const raytrace_state& state) {
 }
 void get_render(color_image& image, const raytrace_state& state) {
   check_image(image, state.width, state.height, true);
-  auto scale = 1.0f / (float)state.samples;
   for (auto idx = 0; idx < state.width * state.height; idx++) {
-    image.pixels[idx] = state.image[idx] * scale;
+    auto hits         = state.hits[idx];
+    image.pixels[idx] = hits ? state.image[idx] / (float)hits : vec4f{0, 0, 0, 0};
+  }
+}
+
+// Get traversal cost heatmap
+color_image get_heatmap(const raytrace_state& state) {
+  auto heatmap = make_image(state.width, state.height, false);
+  get_heatmap(heatmap, state);
+  return heatmap;
+}
+void get_heatmap(color_image& heatmap, const raytrace_state& state) {
+  check_image(heatmap, state.width, state.height, false);
+  if (state.costs.empty()) {
+    for (auto& pixel : heatmap.pixels) pixel = {0, 0, 0, 1};
+    return;
+  }
+  auto costs = vector<float>(state.width * state.height, 0);
+  for (auto idx = 0; idx < state.width * state.height; idx++) {
+    if (state.hits[idx]) costs[idx] = state.costs[idx] / state.hits[idx];
+  }
+  auto max_cost = 1.0f;
+  for (auto cost : costs) max_cost = max(max_cost, cost);
+  for (auto idx = 0; idx < state.width * state.height; idx++) {
+    heatmap.pixels[idx] = rgb_to_rgba(
+        colormap(costs[idx] / max_cost, colormap_type::inferno));
+  }
+}
+
+// Get convergence map
+color_image get_convergence(const raytrace_state& state) {
+  auto convergence = make_image(state.width, state.height, true);
+  get_convergence(convergence, state);
+  return convergence;
+}
+void get_convergence(color_image& convergence, const raytrace_state& state) {
+  check_image(convergence, state.width, state.height, true);
+  auto max_hits = 1;
+  for (auto hits : state.hits) max_hits = max(max_hits, hits);
+  for (auto idx = 0; idx < state.width * state.height; idx++) {
+    auto error = state.hits[idx] < 2 ? 1 : pixel_error(state, idx);
+    convergence.pixels[idx] = {
+        error, (float)state.hits[idx] / (float)max_hits, 0, 1};
+  }
+}
+
+// Get the estimated error of the image
+float get_error(const raytrace_state& state) {
+  if (state.hits.empty()) return flt_max;
+  auto error = 0.0;
+  for (auto idx = 0; idx < state.width * state.height; idx++) {
+    if (state.hits[idx] < raytrace_adaptive_samples) return flt_max;
+    error += pixel_error(state, idx) * pixel_error(state, idx);
+  }
+  return (float)sqrt(error / state.hits.size());
+}
+
+}  // namespace yocto
+
+// -----------------------------------------------------------------------------
+// IMPLEMENTATION FOR CHECKPOINTS
+// -----------------------------------------------------------------------------
+namespace yocto {
+
+// Version of the checkpoint format, bumped when the layout of the file or
+// the way samples are drawn change.
+const auto raytrace_checkpoint_version = (uint32_t)3;
+
+// Header of checkpoint files. Buffers follow in the order of the state,
+// then the seeds of the merged samples.
+struct raytrace_checkpoint_header {
+  array<char, 8> magic   = {'y', 'o', 'c', 't', 'o', 'r', 't', 's'};
+  uint32_t       version = raytrace_checkpoint_version;
+  int32_t        width   = 0;
+  int32_t        height  = 0;
+  int32_t        samples = 0;
+  uint64_t       hash    = 0;
+  uint64_t       scene   = 0;
+  uint64_t       seed    = 0;
+  uint64_t       costs   = 0;
+  uint64_t       seeds   = 0;
+};
+
+// Hash of the options that change the samples of a render, but the seed.
+static uint64_t checkpoint_hash(const raytrace_params& params) {
+  // 64-bit FNV-1a
+  auto hash      = (uint64_t)14695981039346656037ull;
+  auto hash_word = [&hash](uint64_t word) {
+    hash ^= word;
+    hash *= 1099511628211ull;
+  };
+  hash_word(raytrace_checkpoint_version);
+  hash_word(params.camera);
+  hash_word((uint64_t)params.shader);
+  hash_word((uint64_t)params.sequence);
+  hash_word(params.bounces);
+  hash_word(params.nolights);
+  hash_word(params.samples == 1);
+  return hash;
+}
+
+// Hash of the scene content that changes the samples of a render, so that
+// checkpoints of a scene edited or replaced since are not resumed.
+static uint64_t checkpoint_hash(const scene_data& scene) {
+  // 64-bit FNV-1a, on words rather than bytes since inputs are large
+  auto hash      = (uint64_t)14695981039346656037ull;
+  auto hash_word = [&hash](uint64_t word) {
+    hash = (hash ^ word) * 1099511628211ull;
+  };
+  auto hash_float = [&hash_word](float value) {
+    auto word = (uint32_t)0;
+    memcpy(&word, &value, 4);
+    hash_word(word);
+  };
+  auto hash_vector = [&hash_word](const auto& values) {
+    auto size = values.size() * sizeof(values[0]);
+    auto data = (const unsigned char*)values.data();
+    hash_word(size);
+    for (auto idx = (size_t)0; idx + 8 <= size; idx += 8) {
+      auto word = (uint64_t)0;
+      memcpy(&word, data + idx, 8);
+      hash_word(word);
+    }
+    for (auto idx = size - size % 8; idx < size; idx++) hash_word(data[idx]);
+  };
+
+  // cameras are hashed by field, since they are padded
+  hash_word(scene.cameras.size());
+  for (auto& camera : scene.cameras) {
+    auto frame = array<float, 12>{};
+    memcpy(frame.data(), &camera.frame, sizeof(frame));
+    for (auto value : frame) hash_float(value);
+    hash_word(camera.orthographic);
+    for (auto value : {camera.lens, camera.film, camera.aspect, camera.focus,
+             camera.aperture})
+      hash_float(value);
+  }
+  hash_vector(scene.instances);
+  hash_vector(scene.environments);
+  hash_vector(scene.materials);
+  hash_word(scene.shapes.size());
+  for (auto& shape : scene.shapes) {
+    hash_vector(shape.points);
+    hash_vector(shape.lines);
+    hash_vector(shape.triangles);
+    hash_vector(shape.quads);
+    hash_vector(shape.positions);
+    hash_vector(shape.normals);
+    hash_vector(shape.texcoords);
+    hash_vector(shape.colors);
+    hash_vector(shape.radius);
+  }
+  hash_word(scene.textures.size());
+  for (auto& texture : scene.textures) {
+    hash_word(texture.width);
+    hash_word(texture.height);
+    hash_word(texture.linear);
+    hash_vector(texture.pixelsf);
+    hash_vector(texture.pixelsb);
+  }
+  return hash;
+}
+
+// Save a checkpoint
+bool save_state(const string& filename, const raytrace_state& state,
+    const scene_data& scene, const raytrace_params& params, string& error) {
+  auto path = std::filesystem::u8path(filename);
+  auto temp = path;
+  temp += ".tmp";
+
+  // header
+  auto header    = raytrace_checkpoint_header{};
+  header.width   = state.width;
+  header.height  = state.height;
+  header.samples = state.samples;
+  header.hash    = checkpoint_hash(params);
+  header.scene   = checkpoint_hash(scene);
+  header.seed    = (uint64_t)params.seed;
+  header.costs   = state.costs.size();
+  header.seeds   = state.seeds.size();
+
+  // write
+#ifdef _WIN32
+  auto fs = _wfopen(temp.c_str(), L"wb");
+#else
+  auto fs = fopen(temp.c_str(), "wb");
+#endif
+  if (!fs) {
+    error = filename + ": file not found";
+    return false;
+  }
+  auto write_values = [fs](const auto& values) {
+    return values.empty() ||
+           fwrite(values.data(), sizeof(values[0]), values.size(), fs) ==
+               values.size();
+  };
+  auto ok = fwrite(&header, sizeof(header), 1, fs) == 1 &&
+            write_values(state.image) && write_values(state.hits) &&
+            write_values(state.moments) && write_values(state.costs) &&
+            write_values(state.seeds);
+  if (fclose(fs) != 0) ok = false;
+  if (!ok) {
+    auto ec = std::error_code{};
+    std::filesystem::remove(temp, ec);
+    error = filename + ": write error";
+    return false;
+  }
+
+  // move in place
+  auto ec = std::error_code{};
+  std::filesystem::rename(temp, path, ec);
+  if (ec) {
+    std::filesystem::remove(temp, ec);
+    error = filename + ": write error";
+    return false;
+  }
+  return true;
+}
+
+// Read a checkpoint, checking its format but not its options.
+static bool read_state(const string& filename, raytrace_state& state,
+    raytrace_checkpoint_header& header, string& error) {
+  // open file
+  auto path = std::filesystem::u8path(filename);
+#ifdef _WIN32
+  auto fs = _wfopen(path.c_str(), L"rb");
+#else
+  auto fs = fopen(path.c_str(), "rb");
+#endif
+  if (!fs) {
+    error = filename + ": file not found";
+    return false;
+  }
+
+  // check header
+  auto expected = raytrace_checkpoint_header{};
+  if (fread(&header, sizeof(header), 1, fs) != 1 ||
+      header.magic != expected.magic || header.version != expected.version ||
+      header.width <= 0 || header.height <= 0) {
+    fclose(fs);
+    error = filename + ": unsupported format";
+    return false;
+  }
+
+  // read buffers
+  auto pixels      = (size_t)header.width * (size_t)header.height;
+  auto read_values = [fs](auto& values, size_t count) {
+    values.resize(count);
+    return count == 0 ||
+           fread(values.data(), sizeof(values[0]), count, fs) == count;
+  };
+  state         = raytrace_state{};
+  state.width   = header.width;
+  state.height  = header.height;
+  state.samples = header.samples;
+  auto ok = read_values(state.image, pixels) &&
+            read_values(state.hits, pixels) &&
+            read_values(state.moments, pixels) &&
+            read_values(state.costs, header.costs ? pixels : 0) &&
+            read_values(state.seeds, header.seeds) && fgetc(fs) == EOF;
+  fclose(fs);
+  if (!ok) {
+    error = filename + ": corrupted file";
+    return false;
+  }
+  if (bvh_counting && state.costs.empty()) state.costs.assign(pixels, 0);
+  if (!bvh_counting) state.costs.clear();
+  return true;
+}
+
+// Load a checkpoint
+bool load_state(const string& filename, raytrace_state& state,
+    const scene_data& scene, const raytrace_params& params, string& error) {
+  auto header = raytrace_checkpoint_header{};
+  auto loaded = raytrace_state{};
+  if (!read_state(filename, loaded, header, error)) return false;
+  if (header.scene != checkpoint_hash(scene)) {
+    error = filename + ": checkpoint of a different scene";
+    return false;
+  }
+  if (header.hash != checkpoint_hash(params) ||
+      header.seed != (uint64_t)params.seed || loaded.width != state.width ||
+      loaded.height != state.height) {
+    error = filename + ": checkpoint of a different render";
+    return false;
+  }
+  state = std::move(loaded);
+  return true;
+}
+
+// Merge a checkpoint
+bool merge_state(const string& filename, raytrace_state& state,
+    const scene_data& scene, const raytrace_params& params, string& error) {
+  auto header = raytrace_checkpoint_header{};
+  auto other  = raytrace_state{};
+  if (!read_state(filename, other, header, error)) return false;
+  if (header.scene != checkpoint_hash(scene)) {
+    error = filename + ": checkpoint of a different scene";
+    return false;
+  }
+  if (header.hash != checkpoint_hash(params) ||
+      other.width != state.width || other.height != state.height) {
+    error = filename + ": checkpoint of a different render";
+    return false;
+  }
+
+  // check that no samples are merged twice
+  auto seeds = state.seeds, other_seeds = other.seeds;
+  seeds.push_back(params.seed);
+  other_seeds.push_back((int)header.seed);
+  for (auto seed : other_seeds) {
+    if (std::find(seeds.begin(), seeds.end(), seed) != seeds.end()) {
+      error = filename + ": checkpoint with samples already merged";
+      return false;
+    }
+  }
+
+  // add samples
+  for (auto idx = 0; idx < state.width * state.height; idx++) {
+    state.image[idx] += other.image[idx];
+    state.hits[idx] += other.hits[idx];
+    state.moments[idx] += other.moments[idx];
+  }
+  for (auto idx = 0; idx < (int)state.costs.size(); idx++) {
+    state.costs[idx] += other.costs[idx];
   }
+  state.samples += other.samples;
+  state.seeds.insert(state.seeds.end(), other_seeds.begin(), other_seeds.end());
+  return true;
 }
 
 }  // namespace yocto
@@ -43,6 +43,7 @@
 #include <yocto/yocto_math.h>
 #include <yocto/yocto_sampling.h>
 #include <yocto/yocto_scene.h>
+#include <yocto/yocto_trace.h>
 
 #include <string>
 #include <vector>
@@ -52,16 +53,29 @@
 // -----------------------------------------------------------------------------
 namespace yocto {
 
-// Rendering state
+// Rendering state. Besides the running sum of the samples in `image`, we keep
+// the per-pixel sample count in `hits` and the sum of the squared sample
+// luminance in `moments`, used to estimate the error of each pixel. When
+// bvh queries are counted, we also keep the traversal cost of each pixel.
+// Random numbers are drawn by hashing the pixel, its sample count and the
+// dimension, so no generator state is kept. States merged from checkpoints
+// keep the seeds of their samples, besides the one they are rendered with,
+// so that samples are never merged twice.
 struct raytrace_state {
-  int               width   = 0;
-  int               height  = 0;
-  int               samples = 0;
-  vector<vec4f>     image   = {};
-  vector<int>       hits    = {};
-  vector<rng_state> rngs    = {};
+  int           width   = 0;
+  int           height  = 0;
+  int           samples = 0;
+  vector<vec4f> image   = {};
+  vector<int>   hits    = {};
+  vector<float> moments = {};
+  vector<float> costs   = {};
+  vector<int>   seeds   = {};  // seeds of merged samples
 };
 
+// Scene lights used for direct lighting. These share the representation and
+// the sampling routines of Yocto/Trace.
+using raytrace_lights = trace_lights;
+
 }  // namespace yocto
 
 // -----------------------------------------------------------------------------
@@ -82,20 +96,40 @@ enum struct raytrace_shader_type {
 
 // Options for trace functions
 struct raytrace_params {
-  int                  camera     = 0;
-  int                  resolution = 720;
-  raytrace_shader_type shader     = raytrace_shader_type::raytrace;
-  int                  samples    = 512;
-  int                  bounces    = 4;
-  bool                 noparallel = false;
-  int                  pratio     = 8;
-  float                exposure   = 0;
-  bool                 filmic     = false;
+  int                  camera         = 0;
+  int                  resolution     = 720;
+  raytrace_shader_type shader         = raytrace_shader_type::raytrace;
+  int                  samples        = 512;
+  int                  batch          = 1;
+  int                  seed           = 961748941;
+  sequence_type        sequence       = sequence_type::random;
+  int                  bounces        = 4;
+  bool                 adaptive       = false;
+  float                threshold      = 0.02f;
+  bool                 nolights       = false;
+  bool                 highqualitybvh = true;
+  bool                 widebvh        = true;
+  bool                 trianglesbvh   = false;
+  bool                 linearbvh      = false;
+  bool                 spatialbvh     = false;
+  bool                 lazybvh        = false;
+  string               bvhcache       = "";
+  bool                 packets        = true;
+  bool                 wavefront      = false;
+  bool                 noparallel     = false;
+  int                  tile           = 16;
+  int                  pratio         = 8;
+  float                exposure       = 0;
+  bool                 filmic         = false;
 };
 
 const auto raytrace_shader_names = vector<string>{
     "raytrace", "matte", "eyelight", "normal", "texcoord", "color", "matcap"};
 
+// Kinds of rays, whose bvh queries are counted in the bvh counter group of
+// the same index.
+const auto raytrace_ray_names = vector<string>{"camera", "bounce", "light"};
+
 // Initialize state.
 raytrace_state make_state(
     const scene_data& scene, const raytrace_params& params);
@@ -103,14 +137,58 @@ raytrace_state make_state(
 // Build the bvh acceleration structure.
 bvh_scene make_bvh(const scene_data& scene, const raytrace_params& params);
 
-// Progressively computes an image.
+// Initialize lights.
+raytrace_lights make_lights(
+    const scene_data& scene, const raytrace_params& params);
+
+// Progressively computes an image. Without lights, emission is only found by
+// path tracing.
 void raytrace_samples(raytrace_state& state, const scene_data& scene,
     const bvh_scene& bvh, const raytrace_params& params);
+void raytrace_samples(raytrace_state& state, const scene_data& scene,
+    const bvh_scene& bvh, const raytrace_lights& lights,
+    const raytrace_params& params);
+
+// Save and load a rendering state to a binary checkpoint. Checkpoints are
+// tagged with hashes of the scene content and of the options that change
+// the samples, and with the seed. Loading replaces a state made for the same
+// render, and fails if the image size, the scene, the options or the seed
+// differ, so that a loaded render continues exactly where it stopped when
+// rendered with the same batch. Saves write a temporary file that is then
+// renamed, so that an interrupted save keeps the previous checkpoint.
+bool save_state(const string& filename, const raytrace_state& state,
+    const scene_data& scene, const raytrace_params& params, string& error);
+bool load_state(const string& filename, raytrace_state& state,
+    const scene_data& scene, const raytrace_params& params, string& error);
+
+// Merge a checkpoint of the same render into a state, adding its samples to
+// the ones of the state. Merging fails if the scene or the options differ,
+// or if any of the seeds of the checkpoint samples, including the ones
+// merged into it, is already in the state.
+bool merge_state(const string& filename, raytrace_state& state,
+    const scene_data& scene, const raytrace_params& params, string& error);
 
 // Get resulting render
 color_image get_render(const raytrace_state& state);
 void        get_render(color_image& render, const raytrace_state& state);
 
+// Get the convergence map, that stores the estimated relative error of each
+// pixel in red and its number of samples, relative to the maximum, in green.
+color_image get_convergence(const raytrace_state& state);
+void get_convergence(color_image& convergence, const raytrace_state& state);
+
+// Get the estimated relative error of the image, as the root mean square of
+// the pixel errors. The error is flt_max until every pixel has enough
+// samples for its error to be trusted.
+float get_error(const raytrace_state& state);
+
+// Get the traversal cost heatmap, that colors each pixel by the bvh nodes
+// and primitives its samples visit, on average, relative to the maximum.
+// The cost is known only when bvh queries are counted. Camera packets and
+// wavefronts share their cost evenly among their pixels.
+color_image get_heatmap(const raytrace_state& state);
+void        get_heatmap(color_image& heatmap, const raytrace_state& state);
+
 }  // namespace yocto
 
 #endif